@@ -0,0 +1,32 @@
+# Turn the runtime bitcode into a C++ source that is linked into squanchy
+#
+# cmake -DINPUT=wasm_runtime.bc -DOUTPUT=EmbeddedRuntime.cpp -P EmbedRuntime.cmake
+
+file(READ ${INPUT} RUNTIME_HEX HEX)
+string(LENGTH "${RUNTIME_HEX}" RUNTIME_HEX_LENGTH)
+math(EXPR RUNTIME_SIZE "${RUNTIME_HEX_LENGTH} / 2")
+
+# 16 bytes per line
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," RUNTIME_BYTES "${RUNTIME_HEX}")
+string(REPEAT "0x[0-9a-f][0-9a-f]," 16 RUNTIME_LINE)
+string(REGEX REPLACE "(${RUNTIME_LINE})" "\\1\n    " RUNTIME_BYTES "${RUNTIME_BYTES}")
+
+file(WRITE ${OUTPUT}
+"// Generated from ${INPUT} by EmbedRuntime.cmake, do not edit
+
+#include \"EmbeddedRuntime.h\"
+
+namespace squanchy {
+
+alignas(16) static const unsigned char RuntimeBitcode[${RUNTIME_SIZE}] = {
+    ${RUNTIME_BYTES}};
+
+llvm::MemoryBufferRef getEmbeddedRuntime() {
+  return llvm::MemoryBufferRef(
+      llvm::StringRef(reinterpret_cast<const char *>(RuntimeBitcode),
+                      sizeof(RuntimeBitcode)),
+      \"wasm_runtime.bc\");
+}
+
+} // namespace squanchy
+")
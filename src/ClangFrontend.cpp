@@ -0,0 +1,79 @@
+#include "ClangFrontend.h"
+
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+Expected<std::unique_ptr<Module>>
+compileC(StringRef Path, LLVMContext &Context,
+         const std::vector<std::string> &ExtraArgs) {
+  // Run the driver to get the system include paths of the host
+  std::vector<std::string> Args = {
+      "clang",
+      "-c",
+      "-O0",
+      "-w",
+      "-resource-dir",
+      SQUANCHY_CLANG_RESOURCE_DIR,
+      "-I",
+      SQUANCHY_RUNTIME_INCLUDE_DIR,
+  };
+  Args.insert(Args.end(), ExtraArgs.begin(), ExtraArgs.end());
+  Args.push_back(Path.str());
+
+  std::vector<const char *> ArgPtrs;
+  for (auto &Arg : Args) {
+    ArgPtrs.push_back(Arg.c_str());
+  }
+
+  IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts =
+      new clang::DiagnosticOptions();
+  auto Diags = clang::CompilerInstance::createDiagnostics(
+      DiagOpts.get(), new clang::TextDiagnosticPrinter(errs(), DiagOpts.get()));
+
+  clang::CreateInvocationOptions Options;
+  Options.Diags = Diags;
+  std::shared_ptr<clang::CompilerInvocation> Invocation =
+      clang::createInvocation(ArgPtrs, std::move(Options));
+  if (!Invocation) {
+    return make_error<StringError>("invalid clang arguments for " + Path,
+                                   inconvertibleErrorCode());
+  }
+
+  // Keep the functions optimizable, squanchy runs its own pipelines
+  auto &CodeGenOpts = Invocation->getCodeGenOpts();
+  CodeGenOpts.DisableO0ImplyOptNone = true;
+  CodeGenOpts.DiscardValueNames = true;
+  Invocation->getFrontendOpts().DisableFree = false;
+
+  clang::CompilerInstance Clang;
+  Clang.setInvocation(std::move(Invocation));
+  Clang.setDiagnostics(Diags.get());
+
+  // Generate straight into the context of the deobfuscator
+  clang::EmitLLVMOnlyAction Action(&Context);
+  if (!Clang.ExecuteAction(Action)) {
+    return make_error<StringError>("clang failed to compile " + Path,
+                                   inconvertibleErrorCode());
+  }
+
+  auto M = Action.takeModule();
+  if (!M) {
+    return make_error<StringError>("clang produced no module for " + Path,
+                                   inconvertibleErrorCode());
+  }
+
+  return std::move(M);
+}
+
+} // namespace squanchy
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+namespace llvm {
+class LLVMContext;
+class Module;
+} // namespace llvm
+
+namespace squanchy {
+
+/*
+ * Compile a C file, e.g. the wasm2c output, in-process into Context. Unlike
+ * 'clang -O0' the functions are not marked optnone and the value names are
+ * discarded. wasm-rt.h is found in the runtime directory of the source tree.
+ */
+llvm::Expected<std::unique_ptr<llvm::Module>>
+compileC(llvm::StringRef Path, llvm::LLVMContext &Context,
+         const std::vector<std::string> &ExtraArgs);
+
+} // namespace squanchy
@@ -1,10 +1,27 @@
 #include "Deobfuscator.h"
-
+#ifdef SQUANCHY_WITH_CLANG
+#include "ClangFrontend.h"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/CodeGen/CommandFlags.h"
 #include "llvm/CodeGen/TargetPassConfig.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
@@ -17,10 +34,18 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/SystemUtils.h"
+#include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/Threading.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Evaluator.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 #include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
@@ -32,133 +57,95 @@
 
 #include <llvm/Target/TargetMachine.h>
 
-// Passes
-#include "llvm/Transforms/AggressiveInstCombine/AggressiveInstCombine.h"
-#include "llvm/Transforms/Coroutines/CoroElide.h"
-#include "llvm/Transforms/IPO.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/ADCE.h"
-#include "llvm/Transforms/Scalar/BDCE.h"
-#include "llvm/Transforms/Scalar/CallSiteSplitting.h"
-#include "llvm/Transforms/Scalar/ConstraintElimination.h"
-#include "llvm/Transforms/Scalar/CorrelatedValuePropagation.h"
-#include "llvm/Transforms/Scalar/DeadStoreElimination.h"
-#include "llvm/Transforms/Scalar/EarlyCSE.h"
-#include "llvm/Transforms/Scalar/Float2Int.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar/JumpThreading.h"
-#include "llvm/Transforms/Scalar/LoopSink.h"
-#include "llvm/Transforms/Scalar/LowerExpectIntrinsic.h"
-#include "llvm/Transforms/Scalar/MemCpyOptimizer.h"
-#include "llvm/Transforms/Scalar/MergedLoadStoreMotion.h"
-#include "llvm/Transforms/Scalar/NewGVN.h"
-#include "llvm/Transforms/Scalar/Reassociate.h"
-#include "llvm/Transforms/Scalar/SCCP.h"
-#include "llvm/Transforms/Scalar/SROA.h"
-#include "llvm/Transforms/Scalar/SimpleLoopUnswitch.h"
-#include "llvm/Transforms/Scalar/SimplifyCFG.h"
-#include "llvm/Transforms/Scalar/SpeculativeExecution.h"
-#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
-#include "llvm/Transforms/Utils/AssumeBundleBuilder.h"
-#include "llvm/Transforms/Utils/Cloning.h"
-#include "llvm/Transforms/Utils/EntryExitInstrumenter.h"
-#include "llvm/Transforms/Utils/InjectTLIMappings.h"
-#include "llvm/Transforms/Utils/LibCallsShrinkWrap.h"
-#include "llvm/Transforms/Utils/MoveAutoInit.h"
-#include "llvm/Transforms/Vectorize/VectorCombine.h"
-
+#include "EmbeddedRuntime.h"
 #include "LLVMExtract.h"
+#include "LLVMHelpers.h"
+#include "OptimizationSession.h"
+#include "PipelinePresets.h"
+#include "ResultCache.h"
 #include "SiMBAPass.h"
+#include "ThresholdProfile.h"
+#include "Watchdog.h"
+#include "WasmLifter.h"
 
 using namespace llvm;
 using namespace std;
 
-extern cl::OptionCategory SquanchyCat;
-
-// Command line options
-static cl::opt<bool> KeepWASMRuntime("keep-wasm-runtime",
-                                     cl::desc("Keep WASM runtime functions"),
-                                     cl::init(false), cl::cat(SquanchyCat));
-
-static cl::list<string>
-    FunctionNames("f", cl::desc("List of function names to deobfuscate"),
-                  cl::value_desc("function names"), cl::OneOrMore,
-                  cl::cat(SquanchyCat));
-
-static cl::opt<bool> Verbose("v", cl::desc("Print verbose output"),
-                             cl::cat(SquanchyCat));
-
-static cl::opt<bool>
-    PrintFunctions("list-functions",
-                   cl::desc("List all functions in the module"),
-                   cl::cat(SquanchyCat));
-
-static cl::opt<string> RuntimePath("runtime-path",
-                                   cl::desc("Path to the squanchy runtime"),
-                                   cl::value_desc("path"),
-                                   cl::init("wasm_runtime.bc"),
-                                   cl::cat(SquanchyCat));
-
-static cl::opt<int> OptLevel("O", cl::desc("Optimization level (Default 3)"),
-                             cl::value_desc("level"), cl::init(3),
-                             cl::cat(SquanchyCat));
-
-static cl::opt<string> ModuleName("module-name",
-                                  cl::desc("The module-name used in wasm2c"),
-                                  cl::value_desc("module-name"),
-                                  cl::init("squanchy"), cl::cat(SquanchyCat));
-
-static cl::opt<bool> ExtractRecursive("extract-recursive",
-                                      cl::desc("extract functions recursively"),
-                                      cl::init(false), cl::cat(SquanchyCat));
-
-static cl::opt<bool>
-    ExtractFunction("extract-function",
-                    cl::desc("extract function from the module"),
-                    cl::init(true), cl::cat(SquanchyCat));
-
-// Disable for now as it might lead to wrong results ...
-static cl::opt<bool> ReplaceCallocs("replace-callocs",
-                                    cl::desc("Replace callocs with allocas"),
-                                    cl::init(false), cl::cat(SquanchyCat));
-
-static cl::opt<bool>
-    ReplaceInstanceRefs("replace-instance-refs",
-                        cl::desc("Replace call instance references"),
-                        cl::init(false), cl::cat(SquanchyCat));
-
-static cl::opt<bool>
-    InjectInitializer("inject-initializer",
-                      cl::desc("Inject initializer for wasm instance"),
-                      cl::init(true), cl::cat(SquanchyCat));
-
 namespace squanchy {
-// Needs to be global otherwise we will see a crash during optimization
-llvm::LLVMContext Context;
 
-Deobfuscator::Deobfuscator(const std::string &filename,
-                           const std::string &OutputFile)
-
-    : InputFile(filename), OutputFile(OutputFile) {
+// Everything a slice worker hands back to the main thread
+struct Deobfuscator::SliceResult {
+  bool Success = false;
+  double Milliseconds = 0;
+  std::string Bitcode;
+  json::Array Profile;
+  std::string Log;
+  std::string Error;
+  int CacheHits = 0;
+  int CacheMisses = 0;
+};
 
-  // Load the input file
-  this->M = parse(filename);
+Deobfuscator::Deobfuscator(const std::string &filename,
+                           const std::string &OutputFile,
+                           DeobfuscatorOptions Options)
+
+    : Context(std::make_unique<LLVMContext>()), Options(std::move(Options)),
+      InputFile(filename), OutputFile(OutputFile) {
+  // Load the input file, lazily if the output is extracted anyway
+  if (this->Options.LazyLoad && this->Options.ExtractFunction &&
+      !this->Options.PrintFunctions) {
+    this->M = parseLazy(filename);
+  } else {
+    this->M = parse(filename);
+  }
   if (!M) {
-    llvm::report_fatal_error("[!] Could not parse the input file!", false);
+    errs() << "[!] Could not parse the input file!\n";
+    return;
   }
 
   // Get the instruction count
   this->InstructionCountBefore = getInstructionCount(M.get());
 
-  // Load the runtime module
+  Loaded = initialize();
+};
+
+Deobfuscator::Deobfuscator(std::unique_ptr<llvm::LLVMContext> Context,
+                           std::unique_ptr<llvm::Module> Slice,
+                           DeobfuscatorOptions Options)
+    : Context(std::move(Context)), Options(std::move(Options)),
+      M(std::move(Slice)), IsSliceWorker(true) {
+  Loaded = initialize();
+};
+
+llvm::MemoryBufferRef
+Deobfuscator::getRuntimeBuffer(const std::string &RuntimePath) {
   if (RuntimePath.empty()) {
-    llvm::report_fatal_error("[!] Runtime path is empty!", false);
+    return getEmbeddedRuntime();
+  }
+
+  // Read every runtime file once per process
+  static std::mutex Lock;
+  static StringMap<std::unique_ptr<MemoryBuffer>> Buffers;
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto &Buffer = Buffers[RuntimePath];
+  if (!Buffer) {
+    auto File = MemoryBuffer::getFile(RuntimePath);
+    if (!File) {
+      return MemoryBufferRef();
+    }
+    Buffer = std::move(*File);
   }
 
-  this->RuntimeModule = parse(RuntimePath);
+  return Buffer->getMemBufferRef();
+}
+
+bool Deobfuscator::initialize() {
+  // Load the runtime module
+  this->RuntimeModule = parseRuntime();
   if (!RuntimeModule) {
-    llvm::report_fatal_error("[!] Could not parse the runtime file!", false);
+    errs() << "[!] Could not parse the runtime file!\n";
+    return false;
   }
 
   // Override TargetTriple
@@ -166,16 +153,116 @@ Deobfuscator::Deobfuscator(const std::string &filename,
   overrideTarget(this->RuntimeModule.get());
 
   // Initialize the module
-  this->TLII = new TargetLibraryInfoImpl(Triple(M->getTargetTriple()));
+  this->TLII =
+      std::make_unique<TargetLibraryInfoImpl>(Triple(M->getTargetTriple()));
   this->TLI = std::make_unique<TargetLibraryInfo>(*TLII);
-};
 
-Deobfuscator::~Deobfuscator() {}
+  this->Session = std::make_unique<OptimizationSession>(Options);
+  Session->setLog(log());
+
+  this->WD = std::make_unique<Watchdog>();
+  Session->setWatchdog(WD.get());
+
+  // Custom pipeline from a preset, a file or the command line
+  auto CFGPipeline = resolvePipeline(Options.Pipeline, true);
+  auto NoCFGPipeline = resolvePipeline(Options.PipelineNoCFG.empty()
+                                           ? Options.Pipeline
+                                           : Options.PipelineNoCFG,
+                                       false);
+  if (auto Err = Session->setCustomPipeline(CFGPipeline, true)) {
+    errs() << "[!] Could not parse the pipeline: " << toString(std::move(Err))
+           << "\n";
+    return false;
+  }
+  if (auto Err = Session->setCustomPipeline(NoCFGPipeline, false)) {
+    errs() << "[!] Could not parse the nocfg pipeline: "
+           << toString(std::move(Err)) << "\n";
+    return false;
+  }
+
+  if (!Options.PassProfile.empty()) {
+    Session->enableProfiling();
+  }
+  if (Options.AdaptiveSchedule) {
+    Session->enableAdaptiveScheduling();
+  }
+
+  // The cache entries depend on the exact runtime
+  if (!Options.CacheDir.empty()) {
+    auto Runtime = getRuntimeBuffer(Options.RuntimePath);
+    this->RuntimeHash = utohexstr(xxHash64(Runtime.getBuffer()));
+    this->Cache = std::make_unique<ResultCache>(Options.CacheDir);
+  }
+
+  return true;
+}
+
+Deobfuscator::~Deobfuscator() {
+  // The limits are process wide, do not leave them to the next instance
+  if (Options.Thresholds != ThresholdProfile::None && !IsSliceWorker) {
+    resetThresholdProfile();
+  }
+
+  // Tear down everything living in the context before the context itself
+  Session.reset();
+  WD.reset();
+  TLI.reset();
+  TLII.reset();
+  RuntimeModule.reset();
+  M.reset();
+}
+
+void Deobfuscator::initializeTargets() {
+  static std::once_flag Initialized;
+
+  std::call_once(Initialized, []() {
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+    InitializeAllAsmPrinters();
+    InitializeAllAsmParsers();
+  });
+}
 
 std::unique_ptr<llvm::Module> Deobfuscator::parse(const std::string &filename) {
+  // The wasm2c output itself is compiled in-process
+  if (sys::path::extension(filename) == ".c") {
+#ifdef SQUANCHY_WITH_CLANG
+    auto M = compileC(filename, *Context, Options.ClangArgs);
+    if (!M) {
+      errs() << "[!] Could not compile the C file: "
+             << toString(M.takeError()) << "\n";
+      return nullptr;
+    }
+
+    return std::move(*M);
+#else
+    errs() << "[!] squanchy was built without SQUANCHY_CLANG_FRONTEND, "
+              "compile the C file with 'clang -S -emit-llvm' first\n";
+    return nullptr;
+#endif
+  }
+
+  auto Buffer = MemoryBuffer::getFile(filename);
+  if (!Buffer) {
+    return nullptr;
+  }
+
+  // wasm binaries are lifted directly instead of going through wasm2c
+  if (identify_magic((*Buffer)->getBuffer()) == file_magic::wasm_object) {
+    auto M =
+        liftWasm((*Buffer)->getMemBufferRef(), Options.ModuleName, *Context);
+    if (!M) {
+      errs() << "[!] Could not lift the wasm module: "
+             << toString(M.takeError()) << "\n";
+      return nullptr;
+    }
+
+    return std::move(*M);
+  }
+
   SMDiagnostic Err;
 
-  auto M = llvm::parseIRFile(filename, Err, Context);
+  auto M = llvm::parseIR((*Buffer)->getMemBufferRef(), Err, *Context);
   if (!M) {
     return nullptr;
   }
@@ -183,6 +270,159 @@ std::unique_ptr<llvm::Module> Deobfuscator::parse(const std::string &filename) {
   return std::move(M);
 };
 
+std::unique_ptr<llvm::Module> Deobfuscator::parseRuntime() {
+  auto Buffer = getRuntimeBuffer(Options.RuntimePath);
+  if (!Buffer.getBufferSize()) {
+    return nullptr;
+  }
+
+  // A textual runtime given by -runtime-path is parsed completely
+  if (!isBitcode(Buffer.getBuffer().bytes_begin(),
+                 Buffer.getBuffer().bytes_end())) {
+    SMDiagnostic Err;
+    auto Runtime = llvm::parseIR(Buffer, Err, *Context);
+    if (!Runtime) {
+      errs() << "[!] Could not load the runtime:\n";
+      Err.print("squanchy", errs());
+    }
+    return Runtime;
+  }
+
+  // The functions are only read when the linker needs them
+  auto Runtime = getLazyBitcodeModule(Buffer, *Context);
+  if (!Runtime) {
+    errs() << "[!] Could not load the runtime: "
+           << toString(Runtime.takeError()) << "\n";
+    return nullptr;
+  }
+
+  return std::move(*Runtime);
+}
+
+std::unique_ptr<llvm::Module>
+Deobfuscator::parseLazy(const std::string &filename) {
+  // Lifted and compiled modules are built completely anyway
+  file_magic Magic;
+  if (sys::path::extension(filename) == ".c" ||
+      (!identify_magic(filename, Magic) && Magic == file_magic::wasm_object)) {
+    return parse(filename);
+  }
+
+  SMDiagnostic Err;
+
+  // Textual IR is parsed completely, bitcode only reads the function bodies
+  // on materialization
+  auto M = llvm::getLazyIRFileModule(filename, Err, *Context);
+  if (!M) {
+    return nullptr;
+  }
+
+  std::vector<Function *> Worklist;
+  for (auto &FName : Options.Functions) {
+    if (auto F = M->getFunction(FName)) {
+      Worklist.push_back(F);
+    }
+  }
+
+  // The instance initializer is inlined into the targets
+  if (Options.InjectInitializer) {
+    auto Instantiate = "wasm2c_" + Options.ModuleName + "_instantiate";
+    if (auto F = M->getFunction(Instantiate)) {
+      Worklist.push_back(F);
+    }
+  }
+
+  // Materialize everything reachable from the targets, also through global
+  // initializers like the wasm2c elem segments and constant expressions
+  SmallPtrSet<Function *, 32> Needed;
+  SmallPtrSet<const Constant *, 32> Visited;
+
+  std::function<void(Value *)> Visit = [&](Value *V) {
+    if (auto F = dyn_cast<Function>(V)) {
+      if (!Needed.count(F)) {
+        Worklist.push_back(F);
+      }
+      return;
+    }
+
+    auto C = dyn_cast<Constant>(V);
+    if (!C || !Visited.insert(C).second) {
+      return;
+    }
+
+    if (auto GV = dyn_cast<GlobalVariable>(C)) {
+      if (GV->hasInitializer()) {
+        Visit(GV->getInitializer());
+      }
+      return;
+    }
+
+    if (auto GA = dyn_cast<GlobalAlias>(C)) {
+      Visit(GA->getAliasee());
+      return;
+    }
+
+    for (auto &Op : C->operands()) {
+      Visit(Op);
+    }
+  };
+
+  while (!Worklist.empty()) {
+    auto F = Worklist.back();
+    Worklist.pop_back();
+
+    if (!Needed.insert(F).second) {
+      continue;
+    }
+
+    if (auto Err = F->materialize()) {
+      errs() << "[!] Could not materialize " << F->getName() << ": "
+             << toString(std::move(Err)) << "\n";
+      return nullptr;
+    }
+
+    for (auto &I : instructions(F)) {
+      for (auto &Op : I.operands()) {
+        Visit(Op);
+      }
+    }
+  }
+
+  // Everything else becomes a declaration without ever being read
+  int Skipped = 0;
+  for (auto &F : *M) {
+    if (!F.isMaterializable()) {
+      continue;
+    }
+
+    F.deleteBody();
+    F.setComdat(nullptr);
+    Skipped++;
+  }
+
+  if (auto Err = M->materializeAll()) {
+    errs() << "[!] Could not materialize the module: "
+           << toString(std::move(Err)) << "\n";
+    return nullptr;
+  }
+
+  if (Options.Verbose) {
+    log() << "[*] Lazy loading materialized " << Needed.size()
+          << " functions, skipped " << Skipped << "\n";
+  }
+
+  return std::move(M);
+}
+
+void Deobfuscator::setLog(raw_ostream &OS) {
+  Log = &OS;
+  if (Session) {
+    Session->setLog(OS);
+  }
+}
+
+raw_ostream &Deobfuscator::log() { return Log ? *Log : outs(); }
+
 int Deobfuscator::getInstructionCount(llvm::Module *M) {
   int count = 0;
   for (auto &F : *M) {
@@ -202,9 +442,92 @@ int Deobfuscator::getInstructionCount(llvm::Function *F) {
   return count;
 };
 
+double Deobfuscator::getElapsedMs(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - Start)
+      .count();
+}
+
+void Deobfuscator::setError(const std::string &Message) {
+  errs() << "[!] " << Message << "\n";
+  LastError = Message;
+}
+
+void Deobfuscator::reportFunction(const std::string &FName, bool Success,
+                                  int Before, int After, double Ms) {
+  if (!OnFunction) {
+    return;
+  }
+
+  FunctionResult Result;
+  Result.Name = FName;
+  Result.Success = Success;
+  Result.InstructionsBefore = Before;
+  Result.InstructionsAfter = After;
+  Result.Milliseconds = Ms;
+  Result.Error = LastError;
+  OnFunction(Result);
+}
+
+int Deobfuscator::getInstructionCountAfter() {
+  return getInstructionCount(M.get());
+}
+
+// The functions Roots can call or inline, directly, through constants or
+// through global initializers like the function tables
+static void
+collectReachableFunctions(ArrayRef<Function *> Roots,
+                          SmallPtrSetImpl<const Function *> &Reachable) {
+  std::vector<const Function *> Worklist;
+  SmallPtrSet<const Constant *, 32> Visited;
+
+  std::function<void(const Value *)> Visit = [&](const Value *V) {
+    auto C = dyn_cast<Constant>(V);
+    if (!C || !Visited.insert(C).second) {
+      return;
+    }
+
+    if (auto Fn = dyn_cast<Function>(C)) {
+      if (Reachable.insert(Fn).second) {
+        Worklist.push_back(Fn);
+      }
+    } else if (auto GV = dyn_cast<GlobalVariable>(C)) {
+      if (GV->hasInitializer()) {
+        Visit(GV->getInitializer());
+      }
+    } else if (auto GA = dyn_cast<GlobalAlias>(C)) {
+      Visit(GA->getAliasee());
+    } else {
+      for (auto &Op : C->operands()) {
+        Visit(Op);
+      }
+    }
+  };
+
+  for (auto Root : Roots) {
+    Visit(Root);
+  }
+
+  while (!Worklist.empty()) {
+    auto Fn = Worklist.back();
+    Worklist.pop_back();
+
+    for (auto &I : instructions(Fn)) {
+      for (auto &Op : I.operands()) {
+        Visit(Op);
+      }
+    }
+  }
+}
+
 bool Deobfuscator::deobfuscate() {
+  if (Options.Functions.empty() && !Options.PrintFunctions) {
+    errs() << "[!] No functions to deobfuscate\n";
+    return false;
+  }
+
   // Print the functions
-  if (PrintFunctions) {
+  if (Options.PrintFunctions) {
     int i = 0;
     for (auto &F : *M) {
       if (F.isDeclaration())
@@ -216,58 +539,357 @@ bool Deobfuscator::deobfuscate() {
     return true;
   }
 
-  // Deobfuscate the functions
-  for (auto &FName : FunctionNames) {
-    auto F = M->getFunction(FName);
-    if (!F) {
-      errs() << "[!] Function " << FName << " not found!\n";
+  // Only keep what the functions can reach
+  if (Options.ExtractFirst) {
+    int InstCountBefore = getInstructionCount(M.get());
+    if (!extractTargets(M.get(), Options.Functions)) {
       return false;
     }
 
-    if (F->Function::isDeclaration()) {
-      errs() << "[!] Function " << FName << " is a declaration!\n";
+    log() << "[*] Extracted the functions before optimizing, instructions: "
+          << InstCountBefore << " -> " << getInstructionCount(M.get())
+          << "\n";
+  }
+
+  // Deobfuscate the functions
+  if (Options.Jobs > 1 && Options.Functions.size() > 1) {
+    if (!deobfuscateParallel()) {
       return false;
     }
+  } else {
+    std::vector<Function *> Streamed;
+    for (size_t i = 0; i < Options.Functions.size(); i++) {
+      auto &FName = Options.Functions[i];
+      auto F = M->getFunction(FName);
+      if (!F) {
+        errs() << "[!] Function " << FName << " not found!\n";
+        return false;
+      }
 
-    outs() << "[*] Deobfuscating function: " << FName << "\n";
+      if (F->Function::isDeclaration()) {
+        errs() << "[!] Function " << FName << " is a declaration!\n";
+        return false;
+      }
 
-    int InstCountBefore = getInstructionCount(F);
+      log() << "[*] Deobfuscating function: " << FName << "\n";
 
-    if (!deobfuscateFunction(F)) {
-      return false;
+      auto Start = std::chrono::steady_clock::now();
+      int InstCountBefore = getInstructionCount(F);
+
+      if (!deobfuscateFunction(F)) {
+        reportFunction(FName, false, InstCountBefore, 0, getElapsedMs(Start));
+        return false;
+      }
+
+      int InstCountAfter = getInstructionCount(F);
+
+      log() << "[*] Instruction count before: " << InstCountBefore
+            << " after: " << InstCountAfter << "\n";
+      reportFunction(FName, true, InstCountBefore, InstCountAfter,
+                     getElapsedMs(Start));
+
+      // The body is not needed anymore once it is written, unless a target
+      // still to come inlines or extracts it
+      if (Options.StreamOutput) {
+        if (!streamFunction(F)) {
+          return false;
+        }
+        Streamed.push_back(F);
+
+        std::vector<Function *> Remaining;
+        for (size_t j = i + 1; j < Options.Functions.size(); j++) {
+          if (auto RF = M->getFunction(Options.Functions[j])) {
+            Remaining.push_back(RF);
+          }
+        }
+
+        SmallPtrSet<const Function *, 32> Reachable;
+        collectReachableFunctions(Remaining, Reachable);
+
+        bool Deleted = false;
+        llvm::erase_if(Streamed, [&](Function *SF) {
+          if (Reachable.count(SF)) {
+            return false;
+          }
+          SF->deleteBody();
+          Deleted = true;
+          return true;
+        });
+
+        if (Deleted) {
+          Session->invalidate();
+        }
+      }
     }
+  }
 
-    int InstCountAfter = getInstructionCount(F);
+  if (Cache) {
+    log() << "[*] Cache hits: " << Cache->getHits()
+          << " misses: " << Cache->getMisses() << "\n";
+  }
 
-    outs() << "[*] Instruction count before: " << InstCountBefore
-           << " after: " << InstCountAfter << "\n";
+  // Every function was written already
+  if (Options.StreamOutput) {
+    if (!Options.PassProfile.empty()) {
+      writePassProfile();
+    }
+    return true;
   }
 
   // 9. Extract the function and globals
-  if (ExtractFunction) {
-    LLVMExtract(M.get(), FunctionNames, {"data_segment_data.*"},
-                ExtractRecursive);
+  if (Options.ExtractFunction) {
+    LLVMExtract(M.get(), Options.Functions, {"data_segment_data.*"},
+                Options.ExtractRecursive);
   }
 
   // 11. Optimize the functions with module passes enabled (folds the code
   // further)
   optimizeModule(M.get());
 
-  for (auto &FName : FunctionNames) {
+  if (!Options.PassProfile.empty()) {
+    writePassProfile();
+  }
+
+  for (auto &FName : Options.Functions) {
     auto F = M->getFunction(FName);
     if (!F) {
       continue;
     }
 
-    outs() << "[*] Function: " << FName
-           << " Instruction count: " << getInstructionCount(F) << "\n";
+    log() << "[*] Function: " << FName
+          << " Instruction count: " << getInstructionCount(F) << "\n";
+  }
+
+  // 12. Write the output file
+  writeOutput();
+
+  return true;
+};
+
+bool Deobfuscator::deobfuscateParallel() {
+  for (auto &FName : Options.Functions) {
+    auto F = M->getFunction(FName);
+    if (!F) {
+      errs() << "[!] Function " << FName << " not found!\n";
+      return false;
+    }
+
+    if (F->Function::isDeclaration()) {
+      errs() << "[!] Function " << FName << " is a declaration!\n";
+      return false;
+    }
+  }
+
+  // Serialize the input once, every worker loads it lazily into its own
+  // context and only materializes its slice
+  SmallVector<char, 0> Buffer;
+  {
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(*M, OS);
+  }
+  MemoryBufferRef Input(StringRef(Buffer.data(), Buffer.size()), InputFile);
+
+  // The limits are process wide, pick them once for the largest function.
+  // The workers inline on their own, measure what inlining will leave like
+  // the sequential mode does
+  if (Options.Thresholds != ThresholdProfile::None) {
+    Function *Largest = nullptr;
+    unsigned LargestSize = 0;
+    for (auto &FName : Options.Functions) {
+      auto F = M->getFunction(FName);
+      unsigned Instructions, Blocks;
+      getInlinedSize(F, true, Instructions, Blocks);
+      if (!Largest || Instructions > LargestSize) {
+        Largest = F;
+        LargestSize = Instructions;
+      }
+    }
+    applyThresholds(Largest, true);
+  }
+
+  unsigned NumWorkers =
+      std::min<unsigned>(Options.Jobs, Options.Functions.size());
+  log() << "[*] Deobfuscating " << Options.Functions.size()
+        << " functions with " << NumWorkers << " workers\n";
+
+  std::vector<SliceResult> Results(Options.Functions.size());
+  std::atomic<size_t> Next(0);
+
+  // The workers buffer their messages, a finished slice prints them in one
+  // piece
+  std::mutex LogLock;
+
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0; i < NumWorkers; i++) {
+    Workers.emplace_back([&]() {
+      for (size_t Idx = Next++; Idx < Options.Functions.size(); Idx = Next++) {
+        auto &Result = Results[Idx];
+        auto Start = std::chrono::steady_clock::now();
+        Result.Success =
+            deobfuscateSlice(Input, Options.Functions[Idx], Result);
+        Result.Milliseconds = getElapsedMs(Start);
+
+        std::lock_guard<std::mutex> Guard(LogLock);
+        log() << Result.Log;
+        log().flush();
+      }
+    });
+  }
+
+  for (auto &W : Workers) {
+    W.join();
+  }
+
+  // Keep the profile records in the order of the functions
+  for (auto &Result : Results) {
+    Session->appendProfile(std::move(Result.Profile));
+    if (Cache) {
+      Cache->addStats(Result.CacheHits, Result.CacheMisses);
+    }
+  }
+
+  // The spliced bodies reference the runtime helpers
+  if (!linkRuntime()) {
+    for (size_t i = 0; i < Options.Functions.size(); i++) {
+      auto &FName = Options.Functions[i];
+      reportFunction(FName, false, getInstructionCount(M->getFunction(FName)),
+                     0, Results[i].Milliseconds);
+    }
+    return false;
+  }
+
+  // Put the deobfuscated bodies back into the input module
+  for (size_t i = 0; i < Options.Functions.size(); i++) {
+    auto &FName = Options.Functions[i];
+    LastError = Results[i].Error;
+    if (!Results[i].Success) {
+      errs() << "[!] Could not deobfuscate function " << FName << "\n";
+      reportFunction(FName, false, getInstructionCount(M->getFunction(FName)),
+                     0, Results[i].Milliseconds);
+      return false;
+    }
+
+    auto Slice = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Results[i].Bitcode), FName), *Context);
+    if (!Slice) {
+      errs() << "[!] Could not load the result of " << FName << ": "
+             << toString(Slice.takeError()) << "\n";
+      return false;
+    }
+
+    auto F = M->getFunction(FName);
+    int InstCountBefore = getInstructionCount(F);
+
+    // Write the result directly, the input module keeps its body
+    if (Options.StreamOutput) {
+      auto SliceF = (*Slice)->getFunction(FName);
+      log() << "[*] Function: " << FName
+            << " Instruction count before: " << InstCountBefore
+            << " after: " << getInstructionCount(SliceF) << "\n";
+      reportFunction(FName, true, InstCountBefore, getInstructionCount(SliceF),
+                     Results[i].Milliseconds);
+
+      if (!streamFunction(SliceF)) {
+        return false;
+      }
+      F->deleteBody();
+      continue;
+    }
+
+    Squanchy::spliceFunctionBody(F, (*Slice)->getFunction(FName));
+
+    log() << "[*] Function: " << FName
+          << " Instruction count before: " << InstCountBefore
+          << " after: " << getInstructionCount(F) << "\n";
+    reportFunction(FName, true, InstCountBefore, getInstructionCount(F),
+                   Results[i].Milliseconds);
+  }
+
+  return true;
+}
+
+bool Deobfuscator::deobfuscateSlice(MemoryBufferRef Input,
+                                    const std::string &FName,
+                                    SliceResult &Result) {
+  raw_string_ostream Log(Result.Log);
+
+  auto WorkerContext = std::make_unique<LLVMContext>();
+
+  auto Slice = getLazyBitcodeModule(Input, *WorkerContext);
+  if (!Slice) {
+    errs() << "[!] Could not load the slice of " << FName << ": "
+           << toString(Slice.takeError()) << "\n";
+    return false;
+  }
+
+  if (!extractTargets(Slice->get(), {FName})) {
+    return false;
+  }
+
+  Log << "[*] Deobfuscating function: " << FName << "\n";
+
+  // Same options, but only for this function
+  DeobfuscatorOptions WorkerOptions = Options;
+  WorkerOptions.Functions = {FName};
+
+  Deobfuscator Worker(std::move(WorkerContext), std::move(*Slice),
+                      std::move(WorkerOptions));
+  if (!Worker.isLoaded()) {
+    return false;
+  }
+  Worker.setLog(Log);
+
+  bool Success = Worker.deobfuscateFunction(Worker.M->getFunction(FName));
+  Result.Error = Worker.LastError;
+
+  Result.Profile = Worker.Session->takeProfile();
+  if (Worker.Cache) {
+    Result.CacheHits = Worker.Cache->getHits();
+    Result.CacheMisses = Worker.Cache->getMisses();
+  }
+  Log.flush();
+  if (!Success) {
+    return false;
+  }
+
+  raw_string_ostream OS(Result.Bitcode);
+  WriteBitcodeToFile(*Worker.M, OS);
+  OS.flush();
+
+  return true;
+}
+
+bool Deobfuscator::extractTargets(llvm::Module *Mod,
+                                  std::vector<std::string> Roots) {
+  // Keep the instance initializer around, it is inlined into the functions
+  string InstantiateName = "wasm2c_" + Options.ModuleName + "_instantiate";
+  if (Options.InjectInitializer && Mod->getFunction(InstantiateName)) {
+    Roots.push_back(InstantiateName);
+  }
+
+  for (auto &Root : Roots) {
+    if (!Mod->getFunction(Root)) {
+      errs() << "[!] Function " << Root << " not found\n";
+      return false;
+    }
+  }
+
+  // Modules without data segments have nothing for the regex to match
+  std::vector<std::string> Globals;
+  for (auto &GV : Mod->globals()) {
+    if (GV.getName().starts_with("data_segment_data")) {
+      Globals.push_back("data_segment_data.*");
+      break;
+    }
   }
 
-  // 12. Write the output file
-  writeOutput();
+  if (LLVMExtract(Mod, Roots, Globals, true)) {
+    errs() << "[!] Could not extract the functions\n";
+    return false;
+  }
 
   return true;
-};
+}
 
 // ptr nocapture noundef readonly %0
 bool Deobfuscator::isWasm2CFunction(llvm::Function *F) {
@@ -284,244 +906,296 @@ bool Deobfuscator::isWasm2CFunction(llvm::Function *F) {
   return true;
 };
 
-void Deobfuscator::linkRuntime() {
+namespace {
+
+// Collects the errors of the linker, the default handler exits the process
+struct LinkerDiagnostics : public DiagnosticHandler {
+  std::string &Errors;
+
+  LinkerDiagnostics(std::string &Errors) : Errors(Errors) {}
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    if (DI.getSeverity() == DS_Error) {
+      raw_string_ostream OS(Errors);
+      DiagnosticPrinterRawOStream DP(OS);
+      OS << (Errors.empty() ? "" : ", ");
+      DI.print(DP);
+    }
+    return true;
+  }
+};
+
+} // namespace
+
+bool Deobfuscator::linkRuntime() {
+  // Later functions reuse the already linked helpers
+  if (RuntimeLinked) {
+    return true;
+  }
+
+  if (!RuntimeModule) {
+    setError("The runtime module could not be linked before");
+    return false;
+  }
+
+  // Set DataLayout
+  RuntimeModule->setDataLayout(M->getDataLayout());
+
   llvm::Linker L(*M);
 
-  // Clone the runtime module
-  auto RuntimeModule = llvm::CloneModule(*this->RuntimeModule);
+  // The runtime is only linked once, so the module can be moved in
+  std::string Errors;
+  auto PreviousHandler = Context->getDiagnosticHandler();
+  Context->setDiagnosticHandler(std::make_unique<LinkerDiagnostics>(Errors));
+  bool Failed = L.linkInModule(std::move(this->RuntimeModule),
+                               Linker::Flags::OverrideFromSrc);
+  Context->setDiagnosticHandler(std::move(PreviousHandler));
 
-  L.linkInModule(std::move(RuntimeModule), Linker::Flags::OverrideFromSrc);
+  if (Failed) {
+    setError("Could not link the runtime module: " + Errors);
+    return false;
+  }
+
+  RuntimeLinked = true;
+  return true;
 }
 
 void Deobfuscator::optimizeFunction(llvm::Function *F) {
-  if (OptLevel == 0) {
+  if (Options.OptLevel == 0) {
     return;
   }
 
-  // Create a new function pass manager
-  LoopAnalysisManager LAM;
-  FunctionAnalysisManager FAM;
-  CGSCCAnalysisManager CGAM;
-  ModuleAnalysisManager MAM;
-
-  // Register all the basic analyses with the managers.
-  PassBuilder PB;
-
-  PB.registerModuleAnalyses(MAM);
-  PB.registerCGSCCAnalyses(CGAM);
-  PB.registerFunctionAnalyses(FAM);
-  PB.registerLoopAnalyses(LAM);
-  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
-
-  auto FPM = PB.buildFunctionSimplificationPipeline(OptimizationLevel::O3,
-                                                    ThinOrFullLTOPhase::None);
-  FPM.run(*F, FAM);
+  Session->runFunctionSimplification(*F);
 
   return;
 }
 
 void Deobfuscator::optimizeFunctionWithCustomPipeline(llvm::Function *F,
                                                       bool SimplifyCFG) {
-  if (OptLevel == 0) {
+  if (Options.OptLevel == 0) {
     return;
   }
 
-  // Create a new function pass manager
-  ModuleAnalysisManager MAM;
-  FunctionAnalysisManager FAM;
-  LoopAnalysisManager LAM;
-  CGSCCAnalysisManager CAM;
-
-  FunctionPassManager FPM;
-  LoopPassManager LPM;
+  // Run Opts until the IR stops changing
+  auto Start = std::chrono::steady_clock::now();
+  uint64_t Hash = Squanchy::getContentHash(*F);
+  std::set<uint64_t> SeenHashes = {Hash};
+  Session->resetSchedule();
+  unsigned SkippedBefore = Session->getSkippedPassRuns();
 
-  llvm::PipelineTuningOptions opts;
-  opts.InlinerThreshold = 0;
-
-  llvm::PassBuilder PB(nullptr, opts);
-
-  PB.registerModuleAnalyses(MAM);
-  PB.registerFunctionAnalyses(FAM);
-  PB.registerLoopAnalyses(LAM);
-  PB.registerCGSCCAnalyses(CAM);
-  PB.crossRegisterProxies(LAM, FAM, CAM, MAM);
-
-  // Run Early SiMBA
-  OptimizationGuide OG;
-  FPM.addPass(SiMBAPass(OG));
+  string StopReason;
+  int Run = 1;
+  for (;; Run++) {
+    int InstCountBefore = getInstructionCount(F);
 
-  // https://github.com/llvm/llvm-project/blob/c9e5c42ad1bba84670d6f7ebe7859f4f12063c5a/llvm/lib/Passes/PassBuilderPipelines.cpp#L1586
-  FPM.addPass(EntryExitInstrumenterPass(false));
+    Session->runCustomPipeline(*F, SimplifyCFG, Run);
 
-  FPM.addPass(LowerExpectIntrinsicPass());
-  if (SimplifyCFG) {
-    FPM.addPass(SimplifyCFGPass());
-  }
-  FPM.addPass(SROAPass(SROAOptions::PreserveCFG));
-  FPM.addPass(EarlyCSEPass());
-  FPM.addPass(CallSiteSplittingPass());
+    int InstCountAfter = getInstructionCount(F);
 
-  // buildModuleOptimizationPipeline
-  // FPM.addPass(LoopVersioningLICMPass());
-  FPM.addPass(Float2IntPass());
+    log() << "[" << Run << "]" << "Before: " << InstCountBefore
+          << " After: " << InstCountAfter << "\n";
 
-  // Add loop passes here
-  // https://github.com/llvm/llvm-project/blob/64075837b5532108a1fe96a5b158feb7a9025694/llvm/lib/Passes/PassBuilderPipelines.cpp#L1473
+    if (WD->isArmed()) {
+      takeSnapshot(F);
+      if (WD->expired()) {
+        StopReason = "watchdog, " + WD->getReason();
+        break;
+      }
+    }
 
-  FPM.addPass(InjectTLIMappings());
+    uint64_t NewHash = Squanchy::getContentHash(*F);
 
-  // https://github.com/llvm/llvm-project/blob/64075837b5532108a1fe96a5b158feb7a9025694/llvm/lib/Passes/PassBuilderPipelines.cpp#L545
-  FPM.addPass(SROAPass(SROAOptions::PreserveCFG));
+    // Only a round of all passes proves the fixpoint
+    bool Woken = false;
+    if (NewHash == Hash) {
+      Woken = Session->wakeAllPasses();
+      if (!Woken) {
+        StopReason = "converged";
+        break;
+      }
+    }
 
-  FPM.addPass(EarlyCSEPass(true));
+    if (Options.MaxIterations && Run >= (int)Options.MaxIterations) {
+      StopReason = "iteration limit reached";
+      break;
+    }
 
-  bool EnableKnowledgeRetention = false;
-  if (EnableKnowledgeRetention)
-    FPM.addPass(AssumeSimplifyPass());
+    auto Elapsed = std::chrono::steady_clock::now() - Start;
+    if (Options.IterationTimeBudget &&
+        Elapsed >= std::chrono::seconds(Options.IterationTimeBudget)) {
+      StopReason = "time budget exhausted";
+      break;
+    }
 
-  bool EnableGVNHoist = true;
-  if (EnableGVNHoist)
-    FPM.addPass(GVNHoistPass());
+    if (Woken) {
+      continue;
+    }
 
-  if (SimplifyCFG) {
-    bool EnableGVNSink = true;
-    if (EnableGVNSink) {
-      FPM.addPass(GVNSinkPass());
-      FPM.addPass(
-          SimplifyCFGPass(SimplifyCFGOptions().convertSwitchRangeToICmp(true)));
+    // An earlier state came back, the rewrites are going in circles
+    if (!SeenHashes.insert(NewHash).second) {
+      StopReason = "oscillating";
+      break;
     }
+    Hash = NewHash;
   }
 
-  FPM.addPass(SpeculativeExecutionPass(true));
-  FPM.addPass(JumpThreadingPass());
-  FPM.addPass(CorrelatedValuePropagationPass());
+  log() << "[*] Custom pipeline stopped after " << Run
+        << " iterations: " << StopReason << "\n";
 
-  if (SimplifyCFG) {
-    FPM.addPass(
-        SimplifyCFGPass(SimplifyCFGOptions().convertSwitchRangeToICmp(true)));
+  if (StopReason != "converged") {
+    Converged = false;
   }
 
-  // Only run instcombine once
-  InstCombineOptions ICO;
-  ICO.setMaxIterations(1);
-
-  FPM.addPass(InstCombinePass(ICO));
-  FPM.addPass(AggressiveInstCombinePass());
-
-  // Optimizes for size
-  FPM.addPass(LibCallsShrinkWrapPass());
-
-  FPM.addPass(TailCallElimPass());
-  FPM.addPass(
-      SimplifyCFGPass(SimplifyCFGOptions().convertSwitchRangeToICmp(true)));
-
-  FPM.addPass(ReassociatePass());
-
-  FPM.addPass(ConstraintEliminationPass());
-
-  // todo add LoopPasss
-  // https://github.com/llvm/llvm-project/blob/64075837b5532108a1fe96a5b158feb7a9025694/llvm/lib/Passes/PassBuilderPipelines.cpp#L627
-
-  if (SimplifyCFG) {
-    FPM.addPass(
-        SimplifyCFGPass(SimplifyCFGOptions().convertSwitchRangeToICmp(true)));
+  if (Options.AdaptiveSchedule) {
+    log() << "[*] Adaptive scheduling skipped "
+          << Session->getSkippedPassRuns() - SkippedBefore << " pass runs\n";
   }
-  FPM.addPass(InstCombinePass(ICO));
-
-  // Delete small array after loop unroll.
-  FPM.addPass(SROAPass(SROAOptions::PreserveCFG));
-
-  FPM.addPass(VectorCombinePass(true));
+}
 
-  // Eliminate redundancies.
-  FPM.addPass(MergedLoadStoreMotionPass());
+void Deobfuscator::writePassProfile() {
+  std::error_code EC;
+  raw_fd_ostream OS(Options.PassProfile, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "[!] Could not open the pass profile " << Options.PassProfile
+           << ": " << EC.message() << "\n";
+    return;
+  }
 
-  bool RunNewGVN = false;
-  if (RunNewGVN)
-    FPM.addPass(NewGVNPass());
-  else
-    FPM.addPass(GVNPass());
+  json::Object Root{{"input", InputFile},
+                    {"opt_level", (int)Options.OptLevel},
+                    {"passes", Session->takeProfile()}};
+  OS << formatv("{0:2}", json::Value(std::move(Root))) << "\n";
 
-  FPM.addPass(SCCPPass());
-  FPM.addPass(BDCEPass());
-  FPM.addPass(InstCombinePass(ICO));
+  log() << "[*] Wrote pass profile to " << Options.PassProfile << "\n";
+}
 
-  FPM.addPass(JumpThreadingPass());
-  FPM.addPass(CorrelatedValuePropagationPass());
+void Deobfuscator::getInlinedSize(llvm::Function *F, bool BeforeInlining,
+                                  unsigned &Instructions, unsigned &Blocks) {
+  // F with every definition it calls, which is what inlining leaves. Before
+  // inlining the instance initializer is still to be injected
+  std::vector<Function *> Worklist = {F};
+  if (BeforeInlining && Options.InjectInitializer) {
+    auto Init = F->getParent()->getFunction("wasm2c_" + Options.ModuleName +
+                                            "_instantiate");
+    if (Init && !Init->isDeclaration()) {
+      Worklist.push_back(Init);
+    }
+  }
 
-  // Finally, do an expensive DCE pass to catch all the dead code exposed by
-  // the simplifications and basic cleanup after all the simplifications.
-  FPM.addPass(ADCEPass());
+  SmallPtrSet<Function *, 16> Seen(Worklist.begin(), Worklist.end());
+  Instructions = 0;
+  Blocks = 0;
+  while (!Worklist.empty()) {
+    auto Fn = Worklist.back();
+    Worklist.pop_back();
+
+    Instructions += Fn->getInstructionCount();
+    Blocks += Fn->size();
+
+    for (auto &I : instructions(Fn)) {
+      auto CB = dyn_cast<CallBase>(&I);
+      auto Callee = CB ? CB->getCalledFunction() : nullptr;
+      if (Callee && !Callee->isDeclaration() && Seen.insert(Callee).second) {
+        Worklist.push_back(Callee);
+      }
+    }
+  }
+}
 
-  // Specially optimize memory movement as it doesn't look like dataflow in SSA.
-  FPM.addPass(MemCpyOptPass());
-  FPM.addPass(DSEPass());
+void Deobfuscator::applyThresholds(llvm::Function *F, bool BeforeInlining) {
+  unsigned Instructions, Blocks;
+  getInlinedSize(F, BeforeInlining, Instructions, Blocks);
 
-  FPM.addPass(MoveAutoInitPass());
+  auto SizeClass =
+      applyThresholdProfile(Options.Thresholds, Instructions, Blocks);
 
-  FPM.addPass(CoroElidePass());
+  log() << "[*] Thresholds for " << F->getName() << ": "
+        << getThresholdProfileName(Options.Thresholds) << "/" << SizeClass
+        << " (" << Instructions << " instructions, " << Blocks
+        << " blocks)\n";
+}
 
-  FPM.addPass(SimplifyCFGPass(SimplifyCFGOptions()
-                                  .convertSwitchRangeToICmp(true)
-                                  .hoistCommonInsts(true)
-                                  .sinkCommonInsts(true)));
-  FPM.addPass(InstCombinePass(ICO));
+void Deobfuscator::optimizeModule(llvm::Module *M) {
+  if (Options.OptLevel == 0) {
+    return;
+  }
 
-  // Run Late SiMBA
-  FPM.addPass(SiMBAPass(OG));
+  if (!Options.ScopedModuleOpt) {
+    Session->runModulePipeline(*M);
+    return;
+  }
 
-  // Run Opts
-  bool DoRun = true;
-  int Run = 1;
-  while (DoRun) {
-    DoRun = false;
+  // Collect the functions reachable from the deobfuscated ones, through
+  // calls, function pointers and global initializers
+  SmallPtrSet<const Function *, 32> Scope;
+  SmallPtrSet<const Constant *, 32> Visited;
+  std::vector<const Function *> Worklist;
 
-    int InstCountBefore = getInstructionCount(F);
+  std::function<void(const Value *)> Visit = [&](const Value *V) {
+    if (auto F = dyn_cast<Function>(V)) {
+      if (!F->isDeclaration() && Scope.insert(F).second) {
+        Worklist.push_back(F);
+      }
+      return;
+    }
 
-    auto HasOpt = FPM.run(*F, FAM);
+    auto C = dyn_cast<Constant>(V);
+    if (!C || !Visited.insert(C).second) {
+      return;
+    }
 
-    int InstCountAfter = getInstructionCount(F);
+    if (auto GV = dyn_cast<GlobalVariable>(C)) {
+      if (GV->hasInitializer()) {
+        Visit(GV->getInitializer());
+      }
+      return;
+    }
 
-    outs() << "[" << Run << "]" << "Before: " << InstCountBefore
-           << " After: " << InstCountAfter << "\n";
-    if (InstCountAfter != InstCountBefore || OG.MBAFound) {
-      DoRun = true;
+    for (auto &Op : C->operands()) {
+      Visit(Op);
     }
   };
-}
 
-void Deobfuscator::optimizeModule(llvm::Module *M) {
-  if (OptLevel == 0) {
-    return;
+  for (auto &FName : Options.Functions) {
+    if (auto F = M->getFunction(FName)) {
+      Visit(F);
+    }
   }
 
-  // Create a new function pass manager
-  LoopAnalysisManager LAM;
-  FunctionAnalysisManager FAM;
-  CGSCCAnalysisManager CGAM;
-  ModuleAnalysisManager MAM;
+  while (!Worklist.empty()) {
+    auto F = Worklist.back();
+    Worklist.pop_back();
+
+    for (auto &I : instructions(F)) {
+      for (auto &Op : I.operands()) {
+        Visit(Op);
+      }
+    }
+  }
 
-  // Register all the basic analyses with the managers.
-  PassBuilder PB;
+  int Defined = 0;
+  for (auto &F : *M) {
+    if (!F.isDeclaration()) {
+      Defined++;
+    }
+  }
 
-  PB.registerModuleAnalyses(MAM);
-  PB.registerCGSCCAnalyses(CGAM);
-  PB.registerFunctionAnalyses(FAM);
-  PB.registerLoopAnalyses(LAM);
-  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  log() << "[*] Module optimization scoped to " << Scope.size() << " of "
+        << Defined << " functions\n";
 
-  auto MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
-  MPM.run(*this->M, MAM);
+  Session->runModulePipeline(*M, &Scope);
 }
 
 bool Deobfuscator::deobfuscateFunction(llvm::Function *F) {
+  LastError.clear();
+
   if (!isWasm2CFunction(F)) {
     errs() << "[!] Function " << F->getName()
            << " is not generated by wasm2c\n";
     return false;
   }
 
-  if (Verbose) {
+  if (Options.Verbose) {
     errs() << "[*] Deobfuscating function: " << F->getName() << "\n";
   }
 
@@ -530,18 +1204,35 @@ bool Deobfuscator::deobfuscateFunction(llvm::Function *F) {
     F->removeFnAttr(Attribute::AttrKind::OptimizeNone);
   }
 
-  // Set DataLayout
-  RuntimeModule->setDataLayout(M->getDataLayout());
+  // 1. Inject the runtime module (only once per input)
+  if (!RuntimeLinked) {
+    if (!linkRuntime()) {
+      return false;
+    }
+    Session->invalidate();
+  }
+
+  // Reuse the result of an identical function
+  std::string CacheKey;
+  if (Cache) {
+    CacheKey = getCacheKey(F);
+    if (loadCachedFunction(F, CacheKey)) {
+      return true;
+    }
+  }
 
-  // 1. Inject the runtime module
-  linkRuntime();
+  Converged = true;
+
+  // Bound the time and memory spent on F
+  WD->arm(Options.FunctionTimeout, Options.FunctionMemoryLimit);
 
   // Set Helper functions to always inline
   setFunctionsAlwayInline();
 
   // 3. Call Init functions
-  if (InjectInitializer) {
-    injectInitializer(F);
+  if (Options.InjectInitializer && !injectInitializer(F)) {
+    releaseWatchdog();
+    return false;
   }
 
   // 4. Store modification to global variables, if any
@@ -565,29 +1256,173 @@ bool Deobfuscator::deobfuscateFunction(llvm::Function *F) {
     }
   }
 
+  // The function was changed outside of the pass managers
+  Session->invalidate(*F);
+
+  // Size the analysis limits after inlining, workers share the limits picked
+  // before they started
+  if (Options.Thresholds != ThresholdProfile::None && !IsSliceWorker) {
+    applyThresholds(F, false);
+  }
+
+  if (checkWatchdog(F)) {
+    return true;
+  }
+
   // 8. Optimize the functions
   optimizeFunctionWithCustomPipeline(F, false);
+  if (checkWatchdog(F)) {
+    return true;
+  }
+
   optimizeFunction(F);
+  if (checkWatchdog(F)) {
+    return true;
+  }
+
   optimizeFunctionWithCustomPipeline(F, true);
+  if (checkWatchdog(F)) {
+    return true;
+  }
 
   // 10. Replace Callocs
-  if (ReplaceCallocs) {
+  if (Options.ReplaceCallocs) {
     // replaceCallocs(F);
   }
 
   // 11. Replace Instance references
-  if (ReplaceInstanceRefs) {
+  if (Options.ReplaceInstanceRefs) {
     replaceInstanceRefs(F);
+    Session->invalidate(*F);
     optimizeFunction(F);
   }
 
   // 12. Replace FUNCREF_TABLE
   replaceFUNCREF_TABLE(F);
+  Session->invalidate(*F);
   optimizeFunction(F);
+  if (checkWatchdog(F)) {
+    return true;
+  }
+
+  releaseWatchdog();
+
+  if (Cache && Converged) {
+    Cache->store(CacheKey, F);
+  } else if (Cache) {
+    log() << "[*] Not caching " << F->getName()
+          << ", the pipeline did not converge\n";
+  }
 
   return true;
 };
 
+void Deobfuscator::takeSnapshot(llvm::Function *F) {
+  unsigned Size = F->getInstructionCount();
+  if (Snapshot && Size >= SnapshotSize) {
+    return;
+  }
+
+  if (Snapshot) {
+    Snapshot->eraseFromParent();
+  }
+
+  ValueToValueMapTy VMap;
+  Snapshot = CloneFunction(F, VMap);
+  Snapshot->setName(F->getName() + ".squanchy.snapshot");
+  Snapshot->setLinkage(GlobalValue::PrivateLinkage);
+  SnapshotSize = Size;
+}
+
+bool Deobfuscator::checkWatchdog(llvm::Function *F) {
+  if (!WD->isArmed()) {
+    return false;
+  }
+
+  takeSnapshot(F);
+  if (!WD->expired()) {
+    return false;
+  }
+
+  // Fall back to the smallest version of F
+  if (Snapshot && SnapshotSize < F->getInstructionCount()) {
+    Squanchy::spliceFunctionBody(F, Snapshot);
+    Session->invalidate(*F);
+  }
+
+  setError("Watchdog stopped function " + F->getName().str() + ": " +
+           WD->getReason() + ", keeping the best result (" +
+           std::to_string(getInstructionCount(F)) + " instructions)");
+
+  // The best result so far is not the final one, keep it out of the cache
+  Converged = false;
+  releaseWatchdog();
+  return true;
+}
+
+void Deobfuscator::releaseWatchdog() {
+  WD->disarm();
+
+  if (Snapshot) {
+    Snapshot->eraseFromParent();
+    Snapshot = nullptr;
+  }
+  SnapshotSize = 0;
+}
+
+std::string Deobfuscator::getCacheKey(llvm::Function *F) {
+  std::string Key;
+  raw_string_ostream OS(Key);
+
+  // Everything that changes the deobfuscated body
+  OS << ResultCache::fingerprint(F) << ";runtime=" << RuntimeHash
+     << ";O=" << Options.OptLevel << ";module=" << Options.ModuleName
+     << ";init=" << Options.InjectInitializer
+     << ";instance-refs=" << Options.ReplaceInstanceRefs
+     << ";max-iterations=" << Options.MaxIterations
+     << ";iteration-time-budget=" << Options.IterationTimeBudget
+     << ";adaptive=" << Options.AdaptiveSchedule
+     << ";inline-max-size=" << Options.InlineMaxSize
+     << ";thresholds=" << (int)Options.Thresholds
+     << ";" << Session->describe();
+
+  for (auto &Arg : Options.LLVMArgs) {
+    OS << ";" << Arg;
+  }
+
+  OS.flush();
+  return Key;
+}
+
+bool Deobfuscator::loadCachedFunction(llvm::Function *F,
+                                      const std::string &Key) {
+  auto Cached = Cache->lookup(Key, *Context);
+  if (!Cached) {
+    return false;
+  }
+
+  llvm::Function *Src = nullptr;
+  for (auto &CF : *Cached) {
+    if (!CF.isDeclaration()) {
+      Src = &CF;
+      break;
+    }
+  }
+
+  if (!Src || Src->arg_size() != F->arg_size()) {
+    errs() << "[!] Ignoring unusable cache entry for " << F->getName()
+           << "\n";
+    return false;
+  }
+
+  Squanchy::spliceFunctionBody(F, Src);
+  Session->invalidate(*F);
+
+  log() << "[*] Cache hit for function: " << F->getName() << "\n";
+
+  return true;
+}
+
 void Deobfuscator::replaceFUNCREF_TABLE(llvm::Function *F) {
   auto FuncRefTable = M->getGlobalVariable("FUNCREF_TABLE");
   if (FuncRefTable) {
@@ -667,7 +1502,7 @@ void Deobfuscator::replaceCallocs(llvm::Function *F) {
 
           // Replace calloc with alloca
           IRBuilder<> Builder(CI);
-          auto Alloca = Builder.CreateAlloca(Type::getInt8Ty(Context),
+          auto Alloca = Builder.CreateAlloca(Type::getInt8Ty(*Context),
                                              Builder.CreateMul(Size, Count));
           CI->replaceAllUsesWith(Alloca);
           CI->eraseFromParent();
@@ -678,22 +1513,192 @@ void Deobfuscator::replaceCallocs(llvm::Function *F) {
 }
 
 void Deobfuscator::writeOutput() {
-  if (OutputFile.empty()) {
-    M->print(outs(), nullptr);
+  if (Options.SplitOutput < 2) {
+    writeModule(M.get(), OutputFile);
     return;
   }
 
+  // Partitions can be compiled in parallel further down the line. They
+  // share the context of M, so they are only serialized here and written
+  // by the workers, each from a context of its own.
+  SmallString<128> Stem(OutputFile.empty() ? InputFile : OutputFile);
+  sys::path::replace_extension(Stem, "");
+
+  std::vector<std::pair<std::string, SmallVector<char, 0>>> Partitions;
+  SplitModule(
+      *M, Options.SplitOutput,
+      [&](std::unique_ptr<Module> Part) {
+        auto Path = (Stem + "." + Twine(Partitions.size()) +
+                     getOutputExtension())
+                        .str();
+        SmallVector<char, 0> Bitcode;
+        {
+          raw_svector_ostream OS(Bitcode);
+          WriteBitcodeToFile(*Part, OS);
+        }
+        Partitions.emplace_back(Path, std::move(Bitcode));
+      },
+      true);
+
+  unsigned NumWorkers = std::min<unsigned>(
+      Partitions.size(), hardware_concurrency().compute_thread_count());
+  std::atomic<size_t> Next(0);
+  std::mutex LogLock;
+
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0; i < NumWorkers; i++) {
+    Workers.emplace_back([&]() {
+      for (size_t Idx = Next++; Idx < Partitions.size(); Idx = Next++) {
+        auto &Path = Partitions[Idx].first;
+        StringRef Bitcode(Partitions[Idx].second.data(),
+                          Partitions[Idx].second.size());
+
+        bool Written = false;
+        if (Options.EmitBC) {
+          std::error_code EC;
+          raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+          if (EC) {
+            errs() << "[!] Could not open the output file " << Path << "\n";
+          } else {
+            OS << Bitcode;
+            Written = true;
+          }
+        } else {
+          LLVMContext PartContext;
+          auto Part =
+              parseBitcodeFile(MemoryBufferRef(Bitcode, Path), PartContext);
+          if (!Part) {
+            errs() << "[!] Could not load the partition " << Path << ": "
+                   << toString(Part.takeError()) << "\n";
+          } else {
+            Written = writeModule(Part->get(), Path);
+          }
+        }
+
+        if (Written) {
+          std::lock_guard<std::mutex> Guard(LogLock);
+          log() << "[*] Wrote partition " << Path << "\n";
+        }
+      }
+    });
+  }
+
+  for (auto &W : Workers) {
+    W.join();
+  }
+}
+
+const char *Deobfuscator::getOutputExtension() {
+  return Options.EmitBC ? ".bc" : ".ll";
+}
+
+bool Deobfuscator::writeModule(llvm::Module *Mod, const std::string &Path) {
+  if (Path.empty()) {
+    if (!Options.EmitBC) {
+      Mod->print(outs(), nullptr);
+    } else if (!CheckBitcodeOutputToConsole(outs())) {
+      WriteBitcodeToFile(*Mod, outs());
+    }
+    return true;
+  }
+
   std::error_code EC;
-  raw_fd_ostream OS(OutputFile, EC, sys::fs::OF_Text);
+  raw_fd_ostream OS(Path, EC,
+                    Options.EmitBC ? sys::fs::OF_None : sys::fs::OF_Text);
   if (EC) {
-    errs() << "[!] Could not open the output file\n";
-    return;
+    errs() << "[!] Could not open the output file " << Path << "\n";
+    return false;
+  }
+
+  if (Options.EmitBC) {
+    WriteBitcodeToFile(*Mod, OS);
+  } else {
+    Mod->print(OS, nullptr);
+  }
+  return true;
+}
+
+std::string Deobfuscator::getStreamPath(const std::string &FName) {
+  // <output>.<function>.ll/.bc next to the output, or the input
+  SmallString<128> Path(OutputFile.empty() ? InputFile : OutputFile);
+  sys::path::replace_extension(Path, "");
+  return (Path + "." + FName + getOutputExtension()).str();
+}
+
+// Remove the globals nothing refers to anymore
+static void dropUnusedGlobals(Module *Mod, GlobalValue *Keep) {
+  bool Changed;
+  do {
+    Changed = false;
+    for (auto &GV : make_early_inc_range(Mod->global_values())) {
+      if (GV.use_empty() && &GV != Keep) {
+        GV.eraseFromParent();
+        Changed = true;
+      }
+    }
+  } while (Changed);
+}
+
+bool Deobfuscator::streamFunction(llvm::Function *F) {
+  // Copy the function, the local data it uses and declarations of the rest
+  // into a module of its own
+  auto Out = std::make_unique<Module>(F->getName(), *Context);
+  Out->setSourceFileName(InputFile);
+  Out->setDataLayout(M->getDataLayout());
+  Out->setTargetTriple(M->getTargetTriple());
+
+  auto OutF = Function::Create(F->getFunctionType(), F->getLinkage(),
+                               F->getAddressSpace(), F->getName(), Out.get());
+  Squanchy::spliceFunctionBody(OutF, F);
+  dropUnusedGlobals(Out.get(), OutF);
+
+  // Pull in the callees as well, like the recursive extraction
+  if (Options.ExtractRecursive) {
+    bool Changed;
+    do {
+      Changed = false;
+      for (auto &Decl : make_early_inc_range(*Out)) {
+        auto Src = F->getParent()->getFunction(Decl.getName());
+        if (!Decl.isDeclaration() || !Src || Src->isDeclaration()) {
+          continue;
+        }
+
+        Squanchy::spliceFunctionBody(&Decl, Src);
+        Decl.setLinkage(Src->getLinkage());
+        Changed = true;
+      }
+      dropUnusedGlobals(Out.get(), OutF);
+    } while (Changed);
+  }
+
+  // The data segments stay definitions, like in the extracted module
+  for (auto &GV : Out->globals()) {
+    auto Src = F->getParent()->getGlobalVariable(GV.getName(), true);
+    if (!GV.isDeclaration() || !GV.getName().starts_with("data_segment_data") ||
+        !Src || !Src->hasInitializer() ||
+        !isa<ConstantData>(Src->getInitializer())) {
+      continue;
+    }
+
+    GV.setInitializer(Src->getInitializer());
+    GV.setLinkage(Src->getLinkage());
+  }
+
+  optimizeModule(Out.get());
+
+  auto Path = getStreamPath(F->getName().str());
+  if (!writeModule(Out.get(), Path)) {
+    return false;
   }
 
-  M->print(OS, nullptr);
+  log() << "[*] Wrote function " << F->getName() << " ("
+        << getInstructionCount(OutF) << " instructions) to " << Path
+        << "\n";
+
+  return true;
 }
 
-void Deobfuscator::injectInitializer(llvm::Function *F) {
+bool Deobfuscator::injectInitializer(llvm::Function *F) {
   // Init the env for the function properly
   auto &Entry = F->getEntryBlock();
   auto &FirstInst = Entry.front();
@@ -702,52 +1707,58 @@ void Deobfuscator::injectInitializer(llvm::Function *F) {
   // Allocate new ST
   // Get wasm2c struct used for the instance
   // w2c_squanchy
-  string StructName = "struct.w2c_" + ModuleName;
+  string StructName = "struct.w2c_" + Options.ModuleName;
   StructType *ST = StructType::getTypeByName(M->getContext(), StructName);
+  if (!ST) {
+    setError("Could not find the struct type " + StructName);
+    return false;
+  }
+
+  // Check everything before the function is changed
+  StructType *STEnv =
+      StructType::getTypeByName(M->getContext(), "struct.w2c_env");
+  auto w2c_env_size = M->getGlobalVariable("w2c_env_size");
+  if (!STEnv && (!w2c_env_size || !w2c_env_size->hasInitializer() ||
+                 !isa<ConstantInt>(w2c_env_size->getInitializer()))) {
+    setError("Could not find w2c_env_size");
+    return false;
+  }
 
-  AllocaInst *w2cInstance = nullptr;
-  if (ST) {
-    // Allocate a real struct type
-    w2cInstance =
-        new AllocaInst(ST, 0, "w2cInstance", &F->getEntryBlock().front());
+  string InstantiateName = "wasm2c_" + Options.ModuleName + "_instantiate";
+  auto wasm2c_squanchy_instantiate = M->getFunction(InstantiateName);
+  if (!wasm2c_squanchy_instantiate) {
+    setError("Could not find " + InstantiateName);
+    return false;
   }
 
-  if (!ST)
-    report_fatal_error("Could not find the struct type");
+  // Allocate a real struct type
+  AllocaInst *w2cInstance =
+      new AllocaInst(ST, 0, "w2cInstance", &F->getEntryBlock().front());
 
   // Get Struct w2c_env
-  StructType *STEnv =
-      StructType::getTypeByName(M->getContext(), "struct.w2c_env");
   AllocaInst *w2c_env = nullptr;
   if (STEnv) {
     // Allocate an ptr for struct w2c_env
     w2c_env = new AllocaInst(STEnv, 0, "w2c_env", &F->getEntryBlock().front());
   } else {
-    // Use w2c_env_size to get the size of the struct
-    auto w2c_env_size = M->getGlobalVariable("w2c_env_size");
-    if (!w2c_env_size) {
-      report_fatal_error("Could not find w2c_env_size");
-    }
-
-    // Allocate an alloca for the struct
+    // Use w2c_env_size to get the size of the struct, allocate an alloca for
+    // it
     auto w2c_env_size_val = cast<ConstantInt>(w2c_env_size->getInitializer());
     auto w2c_env_size_int = w2c_env_size_val->getZExtValue();
-    auto w2c_env_size_type = Type::getIntNTy(Context, w2c_env_size_int * 8);
+    auto w2c_env_size_type = Type::getIntNTy(*Context, w2c_env_size_int * 8);
     w2c_env = new AllocaInst(w2c_env_size_type, 0, "w2c_env",
                              &F->getEntryBlock().front());
   }
 
   // Call wasm2c_squanchy_instantiate(w2c_squanchy* instance, struct
   // w2c_env* w2c_env_instance)
-  auto wasm2c_squanchy_instantiate =
-      M->getFunction("wasm2c_squanchy_instantiate");
-
   IRBuilder<> Builder(&FirstInst);
   auto call_wasm2c_squanchy_instantiate =
       Builder.CreateCall(wasm2c_squanchy_instantiate, {w2cInstance, w2c_env});
 
   // Replace all uses of Arg0 with w2cInstance
   Arg0->replaceAllUsesWith(w2cInstance);
+  return true;
 }
 
 void Deobfuscator::removeCallASMSideEffects(llvm::Function *F) {
@@ -816,7 +1827,7 @@ void Deobfuscator::setFunctionAlwayInline(std::string FunctionName) {
 
 void Deobfuscator::setFunctionsAlwayInline() {
   // wasm2c_squanchy_instantiate function
-  string FunctionName = "wasm2c_" + ModuleName + "_instantiate";
+  string FunctionName = "wasm2c_" + Options.ModuleName + "_instantiate";
   setFunctionAlwayInline(FunctionName);
 
   // Set always inline attribute
@@ -875,43 +1886,80 @@ void Deobfuscator::setFunctionsAlwayInline() {
   setFunctionAlwayInline("func_types_eq");
 }
 
-void Deobfuscator::inlineFunctions(Function *F) {
-  bool Changes;
-  do {
-    // Inline all calls to remill functions
-    Changes = false;
-    std::set<CallInst *> FuncToInline;
-    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E;) {
-      auto II = I;
-      I++;
-      if (CallInst *CI = dyn_cast<CallInst>(&*II)) {
-        // Check if the called inst has a always inline attribute
-        if (CI->isInlineAsm())
-          continue;
+static bool isAlwaysInlineCall(CallInst *CI) {
+  // Check if the called inst has a always inline attribute
+  if (CI->isInlineAsm())
+    return false;
 
-        auto *CF = CI->getCalledFunction();
-        if (!CF)
-          continue;
+  auto *CF = CI->getCalledFunction();
+  if (!CF)
+    return false;
 
-        if (CF->hasFnAttribute(Attribute::AlwaysInline) &&
-            CF->isDeclaration() == false) {
-          FuncToInline.insert(CI);
-        }
+  return CF->hasFnAttribute(Attribute::AlwaysInline) &&
+         CF->isDeclaration() == false;
+}
+
+void Deobfuscator::inlineFunctions(Function *F) {
+  auto Start = std::chrono::steady_clock::now();
+
+  // Scan F once, afterwards only the call sites created by inlining are
+  // visited
+  std::vector<CallInst *> Worklist;
+  for (auto &I : instructions(F)) {
+    if (auto CI = dyn_cast<CallInst>(&I)) {
+      if (isAlwaysInlineCall(CI)) {
+        Worklist.push_back(CI);
       }
     }
+  }
+
+  // Track the size without recounting F after every call
+  DenseMap<Function *, uint64_t> CalleeSizes;
+  uint64_t Size = F->getInstructionCount();
+
+  int Inlined = 0;
+  while (!Worklist.empty() && !WD->expired()) {
+    if (Options.InlineMaxSize && Size > Options.InlineMaxSize) {
+      errs() << "[!] Inline size limit of " << Options.InlineMaxSize
+             << " instructions reached, " << Worklist.size()
+             << " call sites left in " << F->getName() << "\n";
+      break;
+    }
 
-    // Now inline them all
-    for (auto *CI : FuncToInline) {
-      InlineFunctionInfo IFI;
-      InlineFunction(*CI, IFI);
+    auto CI = Worklist.back();
+    Worklist.pop_back();
+
+    auto Callee = CI->getCalledFunction();
+    if (Callee == F) {
+      continue;
     }
 
-    if (FuncToInline.size()) {
-      Changes = true;
+    auto It = CalleeSizes.find(Callee);
+    if (It == CalleeSizes.end()) {
+      It = CalleeSizes.insert({Callee, Callee->getInstructionCount()}).first;
     }
-  } while (Changes);
 
-  return;
+    InlineFunctionInfo IFI;
+    if (!InlineFunction(*CI, IFI).isSuccess()) {
+      continue;
+    }
+
+    Inlined++;
+    Size += It->second;
+
+    for (auto CB : IFI.InlinedCallSites) {
+      auto NewCI = dyn_cast<CallInst>(CB);
+      if (NewCI && isAlwaysInlineCall(NewCI)) {
+        Worklist.push_back(NewCI);
+      }
+    }
+  }
+
+  auto Duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - Start);
+
+  log() << "[*] Inlined " << Inlined << " call sites in "
+        << (int)Duration.count() << "ms\n";
 }
 
 void Deobfuscator::overrideTarget(llvm::Module *M) {
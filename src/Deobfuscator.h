@@ -1,9 +1,14 @@
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "DeobfuscatorOptions.h"
+
 namespace llvm {
 class DominatorTree;
+class MemoryBufferRef;
 class Function;
 class Module;
 class LLVMContext;
@@ -11,32 +16,129 @@ class Evaluator;
 class TargetLibraryInfoImpl;
 class TargetLibraryInfo;
 class Type;
+class raw_ostream;
+namespace json {
+class Array;
+} // namespace json
 } // namespace llvm
 
 namespace squanchy {
 
+class OptimizationSession;
+class ResultCache;
+class Watchdog;
+
+/*
+ * Outcome of a single function, reported as soon as it is deobfuscated
+ */
+struct FunctionResult {
+  std::string Name;
+  bool Success = false;
+  int InstructionsBefore = 0;
+  int InstructionsAfter = 0;
+  double Milliseconds = 0;
+
+  // Why the function could not be deobfuscated or was stopped early, if it
+  // is known
+  std::string Error;
+};
+
 class Deobfuscator {
 public:
-  Deobfuscator(const std::string &filename, const std::string &OutputFile);
+  /*
+   * Load filename, the output is written to OutputFile or printed if it is
+   * empty
+   */
+  Deobfuscator(const std::string &filename, const std::string &OutputFile,
+               DeobfuscatorOptions Options = {});
 
   ~Deobfuscator();
 
+  /*
+   * Initialize the LLVM targets once per process
+   */
+  static void initializeTargets();
+
+  /*
+   * False if the input, the runtime or the pipelines could not be loaded
+   */
+  bool isLoaded() { return Loaded; }
+
   /*
    * Deobfuscate the input file
    */
   bool deobfuscate();
 
+  /*
+   * Called for every function once it is done, from the calling thread
+   */
+  void setFunctionCallback(std::function<void(const FunctionResult &)> F) {
+    OnFunction = std::move(F);
+  }
+
+  /*
+   * Write the progress messages to OS instead of stdout
+   */
+  void setLog(llvm::raw_ostream &OS);
+
+  int getInstructionCountBefore() { return InstructionCountBefore; }
+  int getInstructionCountAfter();
+
   /*
    * Parse the input file
    */
   std::unique_ptr<llvm::Module> parse(const std::string &filename);
 
+  /*
+   * Parse the input file and only materialize the functions reachable from
+   * the functions to deobfuscate
+   */
+  std::unique_ptr<llvm::Module> parseLazy(const std::string &filename);
+
+  /*
+   * Load the runtime given by -runtime-path or the one built into squanchy
+   */
+  std::unique_ptr<llvm::Module> parseRuntime();
+
 private:
-  llvm::TargetLibraryInfoImpl *TLII;
+  /*
+   * Worker instance that deobfuscates a single function slice in its own
+   * context
+   */
+  Deobfuscator(std::unique_ptr<llvm::LLVMContext> Context,
+               std::unique_ptr<llvm::Module> Slice,
+               DeobfuscatorOptions Options);
+
+  // Owned by the instance, declared first so it outlives all modules
+  std::unique_ptr<llvm::LLVMContext> Context;
+
+  std::unique_ptr<llvm::TargetLibraryInfoImpl> TLII;
   std::unique_ptr<llvm::TargetLibraryInfo> TLI;
 
+  DeobfuscatorOptions Options;
+
   std::unique_ptr<llvm::Module> M;
   std::unique_ptr<llvm::Module> RuntimeModule;
+  bool RuntimeLinked = false;
+
+  // Slice workers run concurrently and must not touch process wide options
+  bool IsSliceWorker = false;
+
+  // Pass and analysis managers shared by all functions of M
+  std::unique_ptr<OptimizationSession> Session;
+
+  std::unique_ptr<ResultCache> Cache;
+
+  // Per function limits and the smallest version of the function seen
+  // while they are armed
+  std::unique_ptr<Watchdog> WD;
+  llvm::Function *Snapshot = nullptr;
+  unsigned SnapshotSize = 0;
+  std::string RuntimeHash = "";
+
+  // Cleared when a fixpoint loop stops before the IR settled, such results
+  // depend on timing or limits and are not cached
+  bool Converged = true;
 
   std::string InputFile = "";
 
@@ -44,20 +146,64 @@ private:
 
   int InstructionCountBefore = 0;
 
+  bool Loaded = false;
+  bool initialize();
+
+  /*
+   * The runtime at RuntimePath, read once per process, or the embedded one
+   */
+  static llvm::MemoryBufferRef getRuntimeBuffer(const std::string &RuntimePath);
+
+  llvm::raw_ostream *Log = nullptr;
+  llvm::raw_ostream &log();
+
+  std::function<void(const FunctionResult &)> OnFunction;
+
+  // Reported with the next function, cleared when a function starts
+  std::string LastError = "";
+  void setError(const std::string &Message);
+
+  void reportFunction(const std::string &FName, bool Success, int Before,
+                      int After, double Ms);
+  static double getElapsedMs(std::chrono::steady_clock::time_point Start);
+
   int getInstructionCount(llvm::Module *M);
   int getInstructionCount(llvm::Function *F);
 
   bool deobfuscateFunction(llvm::Function *F);
 
+  void takeSnapshot(llvm::Function *F);
+  bool checkWatchdog(llvm::Function *F);
+  void releaseWatchdog();
+
+  std::string getCacheKey(llvm::Function *F);
+  bool loadCachedFunction(llvm::Function *F, const std::string &Key);
+
+  struct SliceResult;
+  bool deobfuscateParallel();
+  bool deobfuscateSlice(llvm::MemoryBufferRef Input, const std::string &FName,
+                        SliceResult &Result);
+
+  /*
+   * Reduce Mod to the Roots, everything they reference and the data segments
+   */
+  bool extractTargets(llvm::Module *Mod, std::vector<std::string> Roots);
+
   bool isWasm2CFunction(llvm::Function *F);
 
-  void linkRuntime();
+  bool linkRuntime();
 
   void optimizeFunction(llvm::Function *F);
   void optimizeFunctionWithCustomPipeline(llvm::Function *F,
                                           bool SimplifyCFG = true);
   void optimizeModule(llvm::Module *M);
 
+  void getInlinedSize(llvm::Function *F, bool BeforeInlining,
+                      unsigned &Instructions, unsigned &Blocks);
+  void applyThresholds(llvm::Function *F, bool BeforeInlining);
+
+  void writePassProfile();
+
   void inlineFunctions(llvm::Function *F);
 
   void removeCallASMSideEffects(llvm::Function *F);
@@ -69,7 +215,7 @@ private:
   void setFunctionsAlwayInline();
   void removeAlwayInlineAttribute();
 
-  void injectInitializer(llvm::Function *F);
+  bool injectInitializer(llvm::Function *F);
   void handle_funcref_table_init(llvm::Function *F);
 
   void replaceCallocs(llvm::Function *F);
@@ -79,6 +225,14 @@ private:
   void overrideTarget(llvm::Module *M);
 
   void writeOutput();
+  bool writeModule(llvm::Module *Mod, const std::string &Path);
+  const char *getOutputExtension();
+
+  /*
+   * Write F with the declarations and data it references to its own file
+   */
+  bool streamFunction(llvm::Function *F);
+  std::string getStreamPath(const std::string &FName);
 };
 
 } // namespace squanchy
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "ThresholdProfile.h"
+
+namespace squanchy {
+
+/*
+ * Everything that configures a Deobfuscator. The defaults are the ones of
+ * the squanchy command line, the option of each field is noted next to it.
+ */
+struct DeobfuscatorOptions {
+  // Functions to deobfuscate (-f)
+  std::vector<std::string> Functions;
+
+  // Only print the functions of the module (-list-functions)
+  bool PrintFunctions = false;
+
+  // Print verbose output (-v)
+  bool Verbose = false;
+
+  // Keep the WASM runtime functions (-keep-wasm-runtime)
+  bool KeepWASMRuntime = false;
+
+  // Runtime to link, the embedded one if empty (-runtime-path)
+  std::string RuntimePath = "";
+
+  // Optimization level, 0 disables all pipelines (-O)
+  int OptLevel = 3;
+
+  // The module name used by wasm2c (-module-name)
+  std::string ModuleName = "squanchy";
+
+  // Extract the functions and what they reference into the output
+  // (-extract-function, -extract-recursive)
+  bool ExtractFunction = true;
+  bool ExtractRecursive = false;
+
+  // Extract the functions before optimizing (-extract-first)
+  bool ExtractFirst = false;
+
+  // Only materialize what the functions reach of bitcode inputs (-lazy-load)
+  bool LazyLoad = true;
+
+  // Rewrite the wasm instance (-replace-callocs, -replace-instance-refs,
+  // -inject-initializer)
+  bool ReplaceCallocs = false;
+  bool ReplaceInstanceRefs = false;
+  bool InjectInitializer = true;
+
+  // Functions deobfuscated in parallel (-j)
+  unsigned Jobs = 1;
+
+  // Limits of the custom pipeline fixpoint, 0 is unlimited (-max-iterations,
+  // -iteration-time-budget in seconds)
+  unsigned MaxIterations = 0;
+  unsigned IterationTimeBudget = 0;
+
+  // Custom pipelines, a preset, a file or a pass pipeline string. The nocfg
+  // one is derived from Pipeline if empty (-pipeline, -pipeline-nocfg)
+  std::string Pipeline = "squanchy";
+  std::string PipelineNoCFG = "";
+
+  // Skip passes that stopped changing the function (-adaptive-schedule)
+  bool AdaptiveSchedule = false;
+
+  // Limits of the loop stage, 0 is unlimited (-loop-stage-max-size,
+  // -loop-stage-time-budget in milliseconds, -loop-full-unroll-max)
+  unsigned LoopStageMaxSize = 50000;
+  unsigned LoopStageTimeBudget = 5000;
+  unsigned LoopFullUnrollMax = 64;
+
+  // Size based analysis limits (-threshold-profile)
+  ThresholdProfile Thresholds = ThresholdProfile::None;
+
+  // Stop inlining at this size, 0 is unlimited (-inline-max-size). Opt-in,
+  // a capped function keeps its remaining helper calls
+  unsigned InlineMaxSize = 0;
+
+  // Only optimize what the functions reference in the module pass
+  // (-scoped-module-opt)
+  bool ScopedModuleOpt = false;
+
+  // SiMBA output and the persistent database of MBA simplifications
+  // (-simba-debug, -simba-stats, -simba-db)
+  bool SiMBADebug = false;
+  bool SiMBAStats = true;
+  std::string SiMBADatabase = "";
+
+  // Watchdog per function, 0 is unlimited (-function-timeout in seconds,
+  // -function-memory-limit in MB of the whole process heap)
+  unsigned FunctionTimeout = 0;
+  unsigned FunctionMemoryLimit = 0;
+
+  // Persistent cache of deobfuscated functions (-cache-dir)
+  std::string CacheDir = "";
+
+  // JSON profile of the pass invocations (-pass-profile)
+  std::string PassProfile = "";
+
+  // Output format (-stream-output, -emit-bc, -split-output)
+  bool StreamOutput = false;
+  bool EmitBC = false;
+  unsigned SplitOutput = 0;
+
+  // Extra clang arguments for .c inputs (-clang-arg)
+  std::vector<std::string> ClangArgs;
+
+  // The LLVM options the process was configured with, e.g. the limits set
+  // by -override. They change the results, so they are part of the cache key
+  std::vector<std::string> LLVMArgs;
+
+  /*
+   * True if the options change or measure state shared by all deobfuscators
+   * of the process, the LLVM analysis limits, the Z3 timeout or the heap
+   * size. Those must not run concurrently with others.
+   */
+  bool usesProcessWideState() const {
+    return Thresholds != ThresholdProfile::None || FunctionTimeout != 0 ||
+           FunctionMemoryLimit != 0;
+  }
+};
+
+} // namespace squanchy
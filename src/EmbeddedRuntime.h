@@ -0,0 +1,12 @@
+#pragma once
+
+#include <llvm/Support/MemoryBufferRef.h>
+
+namespace squanchy {
+
+/*
+ * Bitcode of runtime/wasm_runtime.cpp, embedded at build time
+ */
+llvm::MemoryBufferRef getEmbeddedRuntime();
+
+} // namespace squanchy
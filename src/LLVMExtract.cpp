@@ -41,16 +41,15 @@
 
 using namespace llvm;
 
-// cl::OptionCategory ExtractCat("llvm-extract Options");
-extern cl::OptionCategory SquanchyCat;
+cl::OptionCategory ExtractCat("llvm-extract Options");
 
 static cl::opt<bool> DeleteFn("delete",
                               cl::desc("Delete specified Globals from Module"),
-                              cl::cat(SquanchyCat));
+                              cl::cat(ExtractCat));
 
 static cl::opt<bool> KeepConstInit("keep-const-init",
                                    cl::desc("Keep initializers of constants"),
-                                   cl::cat(SquanchyCat));
+                                   cl::cat(ExtractCat));
 
 // ExtractRegExpFuncs - The functions, matched via regular expression, to
 // extract from the module.
@@ -58,7 +57,7 @@ static cl::list<std::string>
     ExtractRegExpFuncs("rfunc",
                        cl::desc("Specify function(s) to extract using a "
                                 "regular expression"),
-                       cl::value_desc("rfunction"), cl::cat(SquanchyCat));
+                       cl::value_desc("rfunction"), cl::cat(ExtractCat));
 
 // ExtractBlocks - The blocks to extract from the module.
 static cl::list<std::string> ExtractBlocks(
@@ -72,12 +71,12 @@ static cl::list<std::string> ExtractBlocks(
         "  --bb=f:bb1;bb2 will extract one function with both bb1 and bb2;\n"
         "  --bb=f:bb1 --bb=f:bb2 will extract two functions, one with bb1, one "
         "with bb2."),
-    cl::value_desc("function:bb1[;bb2...]"), cl::cat(SquanchyCat));
+    cl::value_desc("function:bb1[;bb2...]"), cl::cat(ExtractCat));
 
 // ExtractAlias - The alias to extract from the module.
 static cl::list<std::string>
     ExtractAliases("alias", cl::desc("Specify alias to extract"),
-                   cl::value_desc("alias"), cl::cat(SquanchyCat));
+                   cl::value_desc("alias"), cl::cat(ExtractCat));
 
 // ExtractRegExpAliases - The aliases, matched via regular expression, to
 // extract from the module.
@@ -85,22 +84,22 @@ static cl::list<std::string>
     ExtractRegExpAliases("ralias",
                          cl::desc("Specify alias(es) to extract using a "
                                   "regular expression"),
-                         cl::value_desc("ralias"), cl::cat(SquanchyCat));
+                         cl::value_desc("ralias"), cl::cat(ExtractCat));
 
 // ExtractGlobals - The globals to extract from the module.
 static cl::list<std::string>
     ExtractGlobals("glob", cl::desc("Specify global to extract"),
-                   cl::value_desc("global"), cl::cat(SquanchyCat));
+                   cl::value_desc("global"), cl::cat(ExtractCat));
 
 static cl::opt<bool> PreserveBitcodeUseListOrder(
     "preserve-bc-uselistorder",
     cl::desc("Preserve use-list order when writing LLVM bitcode."),
-    cl::init(true), cl::Hidden, cl::cat(SquanchyCat));
+    cl::init(true), cl::Hidden, cl::cat(ExtractCat));
 
 static cl::opt<bool> PreserveAssemblyUseListOrder(
     "preserve-ll-uselistorder",
     cl::desc("Preserve use-list order when writing LLVM assembly."),
-    cl::init(false), cl::Hidden, cl::cat(SquanchyCat));
+    cl::init(false), cl::Hidden, cl::cat(ExtractCat));
 
 int LLVMExtract(Module *M, std::vector<std::string> ExtractFuncs,
                 std::vector<std::string> ExtractRegExpGlobals, bool Recursive) {
@@ -232,8 +231,15 @@ int LLVMExtract(Module *M, std::vector<std::string> ExtractFuncs,
     BBMap.push_back({F, std::move(BBNames)});
   }
 
-  // Use *argv instead of M->getName() to work around a wrong GCC warning.
-  ExitOnError ExitOnErr(std::string(M->getName()) + ": error reading input: ");
+  // Report read errors to the caller, the daemon must survive a bad input
+  auto Failed = [&](Error Err) {
+    if (!Err) {
+      return false;
+    }
+    errs() << M->getName()
+           << ": error reading input: " << toString(std::move(Err)) << "\n";
+    return true;
+  };
 
   if (Recursive) {
     std::vector<llvm::Function *> Workqueue;
@@ -245,7 +251,9 @@ int LLVMExtract(Module *M, std::vector<std::string> ExtractFuncs,
     while (!Workqueue.empty()) {
       Function *F = &*Workqueue.back();
       Workqueue.pop_back();
-      ExitOnErr(F->materialize());
+      if (Failed(F->materialize())) {
+        return 1;
+      }
       for (auto &BB : *F) {
         for (auto &I : BB) {
           CallBase *CB = dyn_cast<CallBase>(&I);
@@ -263,18 +271,17 @@ int LLVMExtract(Module *M, std::vector<std::string> ExtractFuncs,
     }
   }
 
-  auto Materialize = [&](GlobalValue &GV) { ExitOnErr(GV.materialize()); };
-
   // Materialize requisite global values.
   if (!DeleteFn) {
     for (size_t i = 0, e = GVs.size(); i != e; ++i)
-      Materialize(*GVs[i]);
+      if (Failed(GVs[i]->materialize()))
+        return 1;
   } else {
     // Deleting. Materialize every GV that's *not* in GVs.
     SmallPtrSet<GlobalValue *, 8> GVSet(GVs.begin(), GVs.end());
     for (auto &F : *M) {
-      if (!GVSet.count(&F))
-        Materialize(F);
+      if (!GVSet.count(&F) && Failed(F.materialize()))
+        return 1;
     }
   }
 
@@ -300,7 +307,9 @@ int LLVMExtract(Module *M, std::vector<std::string> ExtractFuncs,
     // Now that we have all the GVs we want, mark the module as fully
     // materialized.
     // FIXME: should the GVExtractionPass handle this?
-    ExitOnErr(M->materializeAll());
+    if (Failed(M->materializeAll())) {
+      return 1;
+    }
   }
 
   // Extract the specified basic blocks from the module and erase the existing
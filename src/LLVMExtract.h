@@ -1,9 +1,14 @@
 #include <string>
 #include <vector>
 
+#include "llvm/Support/CommandLine.h"
+
 namespace llvm {
 class Module;
 }
 
+// The llvm-extract options LLVMExtract reads
+extern llvm::cl::OptionCategory ExtractCat;
+
 int LLVMExtract(llvm::Module *M, std::vector<std::string> ExtractFuncs,
                 std::vector<std::string> ExtractRegExpGlobals, bool Recursive);
\ No newline at end of file
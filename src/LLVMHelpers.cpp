@@ -0,0 +1,316 @@
+#include "LLVMHelpers.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+namespace Squanchy {
+
+void spliceFunctionBody(Function *Dst, Function *Src) {
+  Module *DstM = Dst->getParent();
+  Module *SrcM = Src->getParent();
+
+  ValueToValueMapTy VMap;
+
+  // Recursive calls
+  VMap[Src] = Dst;
+
+  // Bind all globals of the source module to their counterparts in the
+  // destination module
+  std::vector<std::pair<GlobalVariable *, GlobalVariable *>> Copied;
+  for (auto &GV : SrcM->global_values()) {
+    if (&GV == Src)
+      continue;
+
+    GlobalValue *Existing = nullptr;
+    if (GV.hasName())
+      Existing = DstM->getNamedValue(GV.getName());
+
+    if (Existing) {
+      VMap[&GV] = Existing;
+      continue;
+    }
+
+    if (auto *SF = dyn_cast<Function>(&GV)) {
+      VMap[&GV] = Function::Create(SF->getFunctionType(),
+                                   GlobalValue::ExternalLinkage, SF->getName(),
+                                   DstM);
+    } else if (auto *SG = dyn_cast<GlobalVariable>(&GV)) {
+      // Local definitions (e.g. constants created during the optimization)
+      // are copied, everything else is only declared
+      bool Copy = SG->hasLocalLinkage() && SG->hasInitializer();
+
+      auto *NG = new GlobalVariable(
+          *DstM, SG->getValueType(), SG->isConstant(),
+          Copy ? SG->getLinkage() : GlobalValue::ExternalLinkage, nullptr,
+          SG->getName(), nullptr, SG->getThreadLocalMode(),
+          SG->getAddressSpace());
+      NG->copyAttributesFrom(SG);
+
+      VMap[&GV] = NG;
+
+      if (Copy)
+        Copied.push_back({NG, SG});
+    }
+  }
+
+  // Initializers can reference other globals, map them once all are known
+  for (auto &P : Copied) {
+    P.first->setInitializer(MapValue(P.second->getInitializer(), VMap));
+  }
+
+  // Drop the old body but keep the linkage (deleteBody resets it)
+  auto Linkage = Dst->getLinkage();
+  Dst->deleteBody();
+
+  auto DstArg = Dst->arg_begin();
+  for (auto &Arg : Src->args()) {
+    DstArg->setName(Arg.getName());
+    VMap[&Arg] = &*DstArg++;
+  }
+
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(Dst, Src, VMap, CloneFunctionChangeType::DifferentModule,
+                    Returns);
+
+  Dst->setLinkage(Linkage);
+}
+
+namespace {
+
+class ContentHasher {
+public:
+  uint64_t Hash = 0;
+
+  void add(uint64_t V) {
+    Hash ^= V + 0x9e3779b97f4a7c15ULL + (Hash << 6) + (Hash >> 2);
+  }
+
+  void add(StringRef S) {
+    add(xxHash64(S));
+    add(S.size());
+  }
+
+  void add(const APInt &A) {
+    add(A.getBitWidth());
+    for (unsigned i = 0; i < A.getNumWords(); i++) {
+      add(A.getRawData()[i]);
+    }
+  }
+
+  void addType(Type *T);
+  void addConstant(const Constant *C);
+  void addFunction(const Function &F);
+
+private:
+  // Local values are hashed by their position in the function
+  DenseMap<const Value *, unsigned> Numbers;
+
+  // Large initializers are referenced many times, hash them once
+  DenseMap<const Constant *, uint64_t> ConstantHashes;
+
+  void addValue(const Value *V);
+  void addInstruction(const Instruction &I);
+};
+
+void ContentHasher::addType(Type *T) {
+  add(T->getTypeID());
+
+  if (auto IT = dyn_cast<IntegerType>(T)) {
+    add(IT->getBitWidth());
+  } else if (auto AT = dyn_cast<ArrayType>(T)) {
+    add(AT->getNumElements());
+    addType(AT->getElementType());
+  } else if (auto VT = dyn_cast<VectorType>(T)) {
+    add(VT->getElementCount().getKnownMinValue());
+    addType(VT->getElementType());
+  } else if (auto ST = dyn_cast<StructType>(T)) {
+    // Named structs can be recursive, their name identifies them
+    if (ST->hasName()) {
+      add(ST->getName());
+      return;
+    }
+    add(ST->isPacked());
+    for (auto ET : ST->elements()) {
+      addType(ET);
+    }
+  } else if (auto PT = dyn_cast<PointerType>(T)) {
+    add(PT->getAddressSpace());
+  } else if (auto FT = dyn_cast<FunctionType>(T)) {
+    add(FT->isVarArg());
+    addType(FT->getReturnType());
+    for (auto PT : FT->params()) {
+      addType(PT);
+    }
+  }
+}
+
+void ContentHasher::addConstant(const Constant *C) {
+  auto It = ConstantHashes.find(C);
+  if (It != ConstantHashes.end()) {
+    add(It->second);
+    return;
+  }
+
+  ContentHasher Sub;
+  Sub.add(C->getValueID());
+  Sub.addType(C->getType());
+
+  if (auto GV = dyn_cast<GlobalValue>(C)) {
+    Sub.add(GV->getName());
+  } else if (auto CI = dyn_cast<ConstantInt>(C)) {
+    Sub.add(CI->getValue());
+  } else if (auto CFP = dyn_cast<ConstantFP>(C)) {
+    Sub.add(CFP->getValueAPF().bitcastToAPInt());
+  } else if (auto CDS = dyn_cast<ConstantDataSequential>(C)) {
+    Sub.add(CDS->getRawDataValues());
+  } else {
+    if (auto CE = dyn_cast<ConstantExpr>(C)) {
+      Sub.add(CE->getOpcode());
+      Sub.add(CE->getRawSubclassOptionalData());
+      if (CE->isCompare()) {
+        Sub.add(CE->getPredicate());
+      }
+      if (auto GEP = dyn_cast<GEPOperator>(CE)) {
+        Sub.addType(GEP->getSourceElementType());
+      }
+    }
+
+    for (auto &Op : C->operands()) {
+      if (auto OpC = dyn_cast<Constant>(Op)) {
+        Sub.addConstant(OpC);
+      } else {
+        // The block of a blockaddress
+        Sub.add(Op->getValueID());
+      }
+    }
+  }
+
+  ConstantHashes[C] = Sub.Hash;
+  add(Sub.Hash);
+}
+
+void ContentHasher::addValue(const Value *V) {
+  if (auto C = dyn_cast<Constant>(V)) {
+    add(1);
+    addConstant(C);
+    return;
+  }
+
+  auto It = Numbers.find(V);
+  if (It != Numbers.end()) {
+    add(2);
+    add(It->second);
+    return;
+  }
+
+  if (auto IA = dyn_cast<InlineAsm>(V)) {
+    add(3);
+    add(IA->getAsmString());
+    add(IA->getConstraintString());
+    return;
+  }
+
+  // Metadata operands
+  add(4);
+  add(V->getValueID());
+}
+
+void ContentHasher::addInstruction(const Instruction &I) {
+  add(I.getOpcode());
+  addType(I.getType());
+  add(I.getRawSubclassOptionalData());
+
+  if (auto Cmp = dyn_cast<CmpInst>(&I)) {
+    add(Cmp->getPredicate());
+  } else if (auto AI = dyn_cast<AllocaInst>(&I)) {
+    addType(AI->getAllocatedType());
+    add(AI->getAlign().value());
+  } else if (auto LI = dyn_cast<LoadInst>(&I)) {
+    add(LI->getAlign().value());
+    add(LI->isVolatile());
+    add((unsigned)LI->getOrdering());
+  } else if (auto SI = dyn_cast<StoreInst>(&I)) {
+    add(SI->getAlign().value());
+    add(SI->isVolatile());
+    add((unsigned)SI->getOrdering());
+  } else if (auto GEP = dyn_cast<GetElementPtrInst>(&I)) {
+    addType(GEP->getSourceElementType());
+  } else if (auto CB = dyn_cast<CallBase>(&I)) {
+    addType(CB->getFunctionType());
+    add(CB->getCallingConv());
+  } else if (auto PN = dyn_cast<PHINode>(&I)) {
+    for (auto BB : PN->blocks()) {
+      add(Numbers.lookup(BB));
+    }
+  } else if (auto SVI = dyn_cast<ShuffleVectorInst>(&I)) {
+    for (int Elt : SVI->getShuffleMask()) {
+      add(Elt);
+    }
+  } else if (auto EVI = dyn_cast<ExtractValueInst>(&I)) {
+    for (auto Idx : EVI->indices()) {
+      add(Idx);
+    }
+  } else if (auto IVI = dyn_cast<InsertValueInst>(&I)) {
+    for (auto Idx : IVI->indices()) {
+      add(Idx);
+    }
+  } else if (auto RMW = dyn_cast<AtomicRMWInst>(&I)) {
+    add(RMW->getOperation());
+    add((unsigned)RMW->getOrdering());
+  }
+
+  add(I.getNumOperands());
+  for (auto &Op : I.operands()) {
+    addValue(Op);
+  }
+}
+
+void ContentHasher::addFunction(const Function &F) {
+  addType(F.getFunctionType());
+
+  // Number everything first, phis and branches refer forward
+  unsigned Next = 0;
+  for (auto &Arg : F.args()) {
+    Numbers[&Arg] = Next++;
+  }
+  for (auto &BB : F) {
+    Numbers[&BB] = Next++;
+    for (auto &I : BB) {
+      Numbers[&I] = Next++;
+    }
+  }
+
+  for (auto &BB : F) {
+    add(BB.size());
+    for (auto &I : BB) {
+      addInstruction(I);
+    }
+  }
+}
+
+} // namespace
+
+uint64_t getContentHash(const Function &F) {
+  ContentHasher H;
+  H.addFunction(F);
+  return H.Hash;
+}
+
+uint64_t getContentHash(const Constant &C) {
+  ContentHasher H;
+  H.addConstant(&C);
+  return H.Hash;
+}
+
+}; // namespace Squanchy
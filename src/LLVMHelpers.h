@@ -1,6 +1,31 @@
+#include <cstdint>
+
 namespace llvm {
+class Constant;
 class Function;
 class Module;
 } // namespace llvm
 
-namespace Squanchy {};
+namespace Squanchy {
+
+/*
+ * Replace the body of Dst with a copy of Src. Src can live in another module
+ * of the same context, its global references are rebound by name to the
+ * globals of Dst's module (missing ones are declared or copied over).
+ */
+void spliceFunctionBody(llvm::Function *Dst, llvm::Function *Src);
+
+/*
+ * Hash of the exact content of F: every instruction with its flags, types,
+ * operands and constant values. Unlike StructuralHash a changed constant or
+ * rewired operand changes the hash. Local value names are ignored and
+ * globals are hashed by name, so the hash is stable across processes.
+ */
+uint64_t getContentHash(const llvm::Function &F);
+
+/*
+ * Hash of the exact value of C, e.g. a global initializer
+ */
+uint64_t getContentHash(const llvm::Constant &C);
+
+}; // namespace Squanchy
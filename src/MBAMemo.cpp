@@ -0,0 +1,621 @@
+#include "MBAMemo.h"
+
+#include <cstring>
+#include <mutex>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+// Signatures grow with 2^Variables
+static const unsigned MaxVariables = 6;
+static const unsigned MaxNodes = 512;
+static const unsigned MaxProgramSize = 64;
+
+/*
+ * Database layout, all fields little endian and 8 byte aligned so the file
+ * can be used straight from a mapping:
+ *
+ *   char     Magic[8]
+ *   Record   Records[]
+ *
+ *   Record:
+ *     uint32 Size            bytes of the record including this header
+ *     uint32 Checksum        xxHash64 of the payload, truncated
+ *     uint32 SignatureLength
+ *     uint32 NumOps
+ *     char   Signature[SignatureLength], zero padded to 8 bytes
+ *     struct { uint64 Kind; uint64 Value; } Ops[NumOps]
+ *
+ * Records are appended with a single write under an exclusive file lock,
+ * readers skip torn or corrupted records by their checksum.
+ */
+static const char DatabaseMagic[8] = {'S', 'Q', 'M', 'B', 'A', 'D', 'B', '1'};
+static const size_t RecordHeaderSize = 16;
+
+namespace {
+
+enum NodeClass { Leaf, Arith, Bitwise };
+
+/*
+ * Classifies integer values into the linear MBA grammar:
+ *   Arith   := Add | Sub | Mul by constant | Shl by constant
+ *   Bitwise := And | Or | Xor (and Not) over bitwise nodes and leaves
+ * Everything else (including bitwise ops over arithmetic) is a leaf, which
+ * keeps every expression a linear MBA over its leaves.
+ */
+class MBAClassifier {
+public:
+  NodeClass get(Value *V) {
+    auto It = Classes.find(V);
+    if (It != Classes.end())
+      return It->second;
+
+    NodeClass C = compute(V);
+    Classes[V] = C;
+    return C;
+  }
+
+  // Does user U treat V as part of its expression?
+  bool absorbs(User *U, Value *V) {
+    auto C = get(U);
+    if (C == Arith)
+      return true;
+
+    return C == Bitwise && get(V) == Bitwise;
+  }
+
+private:
+  DenseMap<Value *, NodeClass> Classes;
+
+  NodeClass compute(Value *V) {
+    auto *BO = dyn_cast<BinaryOperator>(V);
+    if (!BO || !BO->getType()->isIntegerTy() ||
+        BO->getType()->getIntegerBitWidth() > 64)
+      return Leaf;
+
+    auto *C0 = dyn_cast<ConstantInt>(BO->getOperand(0));
+    auto *C1 = dyn_cast<ConstantInt>(BO->getOperand(1));
+
+    switch (BO->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+      return Arith;
+    case Instruction::Mul:
+      return (C0 || C1) ? Arith : Leaf;
+    case Instruction::Shl:
+      return (C1 && C1->getValue().ult(BO->getType()->getIntegerBitWidth()))
+                 ? Arith
+                 : Leaf;
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+      for (auto &Op : BO->operands()) {
+        if (auto *C = dyn_cast<ConstantInt>(Op)) {
+          // Only ~x is part of the grammar
+          if (BO->getOpcode() != Instruction::Xor || !C->isMinusOne())
+            return Leaf;
+          continue;
+        }
+
+        if (get(Op) == Arith)
+          return Leaf;
+      }
+      return Bitwise;
+    default:
+      return Leaf;
+    }
+  }
+};
+
+// A linear MBA rooted at an instruction, variables in DFS order
+struct MBAExpression {
+  Instruction *Root;
+  std::vector<Value *> Variables;
+  std::vector<BinaryOperator *> Nodes; // post order
+  unsigned Width;
+  bool HasArith = false;
+  bool HasBitwise = false;
+};
+
+} // namespace
+
+static uint64_t getMask(unsigned Width) {
+  return Width == 64 ? ~0ULL : ((1ULL << Width) - 1);
+}
+
+static uint64_t evalOp(unsigned Opcode, uint64_t A, uint64_t B) {
+  switch (Opcode) {
+  case Instruction::Add:
+    return A + B;
+  case Instruction::Sub:
+    return A - B;
+  case Instruction::Mul:
+    return A * B;
+  case Instruction::Shl:
+    return B >= 64 ? 0 : A << B;
+  case Instruction::And:
+    return A & B;
+  case Instruction::Or:
+    return A | B;
+  default:
+    return A ^ B;
+  }
+}
+
+static bool collect(Value *V, MBAClassifier &MC, MBAExpression &E,
+                    DenseMap<Value *, unsigned> &Seen) {
+  if (isa<ConstantInt>(V) || Seen.count(V))
+    return true;
+
+  auto C = MC.get(V);
+  if (C == Leaf) {
+    Seen[V] = E.Variables.size();
+    E.Variables.push_back(V);
+    return E.Variables.size() <= MaxVariables;
+  }
+
+  auto *BO = cast<BinaryOperator>(V);
+  if (!collect(BO->getOperand(0), MC, E, Seen) ||
+      !collect(BO->getOperand(1), MC, E, Seen))
+    return false;
+
+  Seen[V] = E.Nodes.size();
+  E.Nodes.push_back(BO);
+  E.HasArith |= C == Arith;
+  E.HasBitwise |= C == Bitwise;
+
+  return E.Nodes.size() <= MaxNodes;
+}
+
+// Truth-table vector over all {0,1} inputs plus the bit width
+static std::string getSignature(MBAExpression &E) {
+  DenseMap<Value *, uint64_t> Values;
+  uint64_t Mask = getMask(E.Width);
+
+  auto valueOf = [&](Value *V) -> uint64_t {
+    if (auto *C = dyn_cast<ConstantInt>(V))
+      return C->getZExtValue();
+    return Values[V];
+  };
+
+  std::string Sig = std::to_string(E.Width) + ":" +
+                    std::to_string(E.Variables.size()) + ":";
+
+  for (unsigned A = 0; A < (1U << E.Variables.size()); A++) {
+    for (unsigned i = 0; i < E.Variables.size(); i++)
+      Values[E.Variables[i]] = (A >> i) & 1;
+
+    for (auto *BO : E.Nodes) {
+      Values[BO] = evalOp(BO->getOpcode(), valueOf(BO->getOperand(0)),
+                          valueOf(BO->getOperand(1))) &
+                   Mask;
+    }
+
+    Sig += utohexstr(Values[E.Root]) + ",";
+  }
+
+  return Sig;
+}
+
+static std::string getSignature(const MBAMemo::Program &P, unsigned Width,
+                                unsigned NumVariables) {
+  uint64_t Mask = getMask(Width);
+
+  std::string Sig =
+      std::to_string(Width) + ":" + std::to_string(NumVariables) + ":";
+
+  for (unsigned A = 0; A < (1U << NumVariables); A++) {
+    std::vector<uint64_t> Stack;
+    for (auto &O : P) {
+      if (O.Kind == MBAMemo::Op::Var) {
+        Stack.push_back((A >> O.Value) & 1);
+        continue;
+      }
+      if (O.Kind == MBAMemo::Op::Const) {
+        Stack.push_back(O.Value & Mask);
+        continue;
+      }
+
+      uint64_t B = Stack.back();
+      Stack.pop_back();
+      uint64_t &Top = Stack.back();
+
+      static const unsigned Opcodes[] = {
+          0, 0, Instruction::Add, Instruction::Sub, Instruction::Mul,
+          Instruction::Shl, Instruction::And, Instruction::Or,
+          Instruction::Xor};
+      Top = evalOp(Opcodes[O.Kind], Top, B) & Mask;
+    }
+
+    Sig += utohexstr(Stack.back()) + ",";
+  }
+
+  return Sig;
+}
+
+static Value *emitProgram(const MBAMemo::Program &P, MBAExpression &E) {
+  IRBuilder<> B(E.Root);
+  Type *Ty = E.Root->getType();
+
+  std::vector<Value *> Stack;
+  for (auto &O : P) {
+    if (O.Kind == MBAMemo::Op::Var) {
+      Stack.push_back(E.Variables[O.Value]);
+      continue;
+    }
+    if (O.Kind == MBAMemo::Op::Const) {
+      Stack.push_back(ConstantInt::get(Ty, O.Value));
+      continue;
+    }
+
+    Value *RHS = Stack.back();
+    Stack.pop_back();
+    Value *LHS = Stack.back();
+    Stack.pop_back();
+
+    switch (O.Kind) {
+    case MBAMemo::Op::Add:
+      Stack.push_back(B.CreateAdd(LHS, RHS));
+      break;
+    case MBAMemo::Op::Sub:
+      Stack.push_back(B.CreateSub(LHS, RHS));
+      break;
+    case MBAMemo::Op::Mul:
+      Stack.push_back(B.CreateMul(LHS, RHS));
+      break;
+    case MBAMemo::Op::Shl:
+      Stack.push_back(B.CreateShl(LHS, RHS));
+      break;
+    case MBAMemo::Op::And:
+      Stack.push_back(B.CreateAnd(LHS, RHS));
+      break;
+    case MBAMemo::Op::Or:
+      Stack.push_back(B.CreateOr(LHS, RHS));
+      break;
+    default:
+      Stack.push_back(B.CreateXor(LHS, RHS));
+      break;
+    }
+  }
+
+  return Stack.back();
+}
+
+// Rebuild V as a program over the variables. The classes of the subtrees are
+// tracked so only linear MBAs are accepted, for those equal signatures imply
+// equal functions.
+static bool buildProgram(Value *V, DenseMap<Value *, unsigned> &VarIndex,
+                         MBAMemo::Program &P, NodeClass &C) {
+  if (P.size() > MaxProgramSize)
+    return false;
+
+  auto It = VarIndex.find(V);
+  if (It != VarIndex.end()) {
+    P.push_back({MBAMemo::Op::Var, It->second});
+    C = Leaf;
+    return true;
+  }
+
+  if (auto *CI = dyn_cast<ConstantInt>(V)) {
+    if (CI->getBitWidth() > 64)
+      return false;
+    P.push_back({MBAMemo::Op::Const, CI->getZExtValue()});
+    C = Arith;
+    return true;
+  }
+
+  auto *BO = dyn_cast<BinaryOperator>(V);
+  if (!BO)
+    return false;
+
+  auto *C0 = dyn_cast<ConstantInt>(BO->getOperand(0));
+  auto *C1 = dyn_cast<ConstantInt>(BO->getOperand(1));
+
+  NodeClass C0Class, C1Class;
+  if (!buildProgram(BO->getOperand(0), VarIndex, P, C0Class) ||
+      !buildProgram(BO->getOperand(1), VarIndex, P, C1Class))
+    return false;
+
+  // Bitwise operands have to be variables or bitwise themselves
+  auto isBitwiseOperand = [](NodeClass OC, ConstantInt *CI) {
+    return !CI && OC != Arith;
+  };
+
+  switch (BO->getOpcode()) {
+  case Instruction::Add:
+    P.push_back({MBAMemo::Op::Add, 0});
+    C = Arith;
+    return true;
+  case Instruction::Sub:
+    P.push_back({MBAMemo::Op::Sub, 0});
+    C = Arith;
+    return true;
+  case Instruction::Mul:
+    if (!C0 && !C1)
+      return false;
+    P.push_back({MBAMemo::Op::Mul, 0});
+    C = Arith;
+    return true;
+  case Instruction::Shl:
+    if (!C1)
+      return false;
+    P.push_back({MBAMemo::Op::Shl, 0});
+    C = Arith;
+    return true;
+  case Instruction::And:
+  case Instruction::Or:
+    if (!isBitwiseOperand(C0Class, C0) || !isBitwiseOperand(C1Class, C1))
+      return false;
+    P.push_back({BO->getOpcode() == Instruction::And ? MBAMemo::Op::And
+                                                      : MBAMemo::Op::Or,
+                 0});
+    C = Bitwise;
+    return true;
+  case Instruction::Xor:
+    if (!(isBitwiseOperand(C0Class, C0) || (C0 && C0->isMinusOne())) ||
+        !(isBitwiseOperand(C1Class, C1) || (C1 && C1->isMinusOne())))
+      return false;
+    P.push_back({MBAMemo::Op::Xor, 0});
+    C = Bitwise;
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool MBAMemo::lookup(const std::string &Signature, Program &P) {
+  auto It = Memo.find(Signature);
+  if (It == Memo.end())
+    return false;
+
+  P = It->second;
+  return true;
+}
+
+void MBAMemo::insert(const std::string &Signature, const Program &P) {
+  Memo[Signature] = P;
+}
+
+int MBAMemo::apply(Function &F, std::vector<Candidate> &Unknown) {
+  MBAClassifier MC;
+
+  // Collect the roots first, replacing expressions changes the users
+  std::vector<WeakTrackingVH> Roots;
+  for (auto &I : instructions(F)) {
+    if (MC.get(&I) == Leaf || I.use_empty())
+      continue;
+
+    for (auto *U : I.users()) {
+      if (!MC.absorbs(U, &I)) {
+        Roots.push_back(&I);
+        break;
+      }
+    }
+  }
+
+  int Replaced = 0;
+  for (auto &Handle : Roots) {
+    auto *Root = dyn_cast_or_null<Instruction>(Handle);
+    if (!Root || Root->getParent() == nullptr)
+      continue;
+
+    // Classes are stale once an expression was replaced
+    MBAClassifier Fresh;
+    if (Fresh.get(Root) == Leaf)
+      continue;
+
+    MBAExpression E;
+    E.Root = Root;
+    E.Width = Root->getType()->getIntegerBitWidth();
+
+    DenseMap<Value *, unsigned> Seen;
+    if (!collect(Root, Fresh, E, Seen))
+      continue;
+
+    // Only mixed expressions are MBAs
+    if (!E.HasArith || !E.HasBitwise)
+      continue;
+
+    std::string Signature = getSignature(E);
+
+    Program P;
+    if (!lookup(Signature, P)) {
+      Misses++;
+
+      Candidate C;
+      C.Root = Root;
+      C.OrigRoot = Root;
+      for (auto *V : E.Variables)
+        C.Variables.push_back(V);
+      C.Signature = Signature;
+      C.Width = E.Width;
+      Unknown.push_back(std::move(C));
+      continue;
+    }
+
+    Hits++;
+
+    Value *New = emitProgram(P, E);
+    Root->replaceAllUsesWith(New);
+    RecursivelyDeleteTriviallyDeadInstructions(Root);
+    Replaced++;
+  }
+
+  return Replaced;
+}
+
+void MBAMemo::learn(std::vector<Candidate> &Unknown) {
+  for (auto &C : Unknown) {
+    Value *V = C.Root;
+
+    // Deleted or left untouched by SiMBA
+    if (!V || V == C.OrigRoot)
+      continue;
+
+    DenseMap<Value *, unsigned> VarIndex;
+    for (unsigned i = 0; i < C.Variables.size(); i++) {
+      if (C.Variables[i])
+        VarIndex[C.Variables[i]] = i;
+    }
+
+    Program P;
+    NodeClass PC;
+    if (!buildProgram(V, VarIndex, P, PC))
+      continue;
+
+    // Only keep forms that provably compute the same linear MBA
+    if (getSignature(P, C.Width, C.Variables.size()) != C.Signature)
+      continue;
+
+    insert(C.Signature, P);
+    Learned++;
+
+    if (hasDatabase())
+      appendToDatabase(C.Signature, P);
+  }
+}
+
+static uint64_t alignTo8(uint64_t Size) { return (Size + 7) & ~7ULL; }
+
+bool MBAMemo::openDatabase(const std::string &Path) {
+  DatabasePath = Path;
+
+  auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+  if (!Buffer) {
+    // Created on the first append
+    if (Buffer.getError() == std::errc::no_such_file_or_directory)
+      return true;
+
+    errs() << "[!] Could not open the SiMBA database " << Path << ": "
+           << Buffer.getError().message() << "\n";
+    DatabasePath.clear();
+    return false;
+  }
+
+  StringRef Data = (*Buffer)->getBuffer();
+  if (Data.empty())
+    return true;
+
+  if (Data.size() < sizeof(DatabaseMagic) ||
+      memcmp(Data.data(), DatabaseMagic, sizeof(DatabaseMagic)) != 0) {
+    errs() << "[!] " << Path << " is not a SiMBA database\n";
+    DatabasePath.clear();
+    return false;
+  }
+
+  using namespace support;
+
+  uint64_t Offset = sizeof(DatabaseMagic);
+  while (Offset + RecordHeaderSize <= Data.size()) {
+    const char *Rec = Data.data() + Offset;
+    uint32_t Size = endian::read32le(Rec);
+    uint32_t Checksum = endian::read32le(Rec + 4);
+    uint32_t SigLength = endian::read32le(Rec + 8);
+    uint32_t NumOps = endian::read32le(Rec + 12);
+
+    // Truncated tail of an interrupted append
+    if (Size < RecordHeaderSize || Offset + Size > Data.size())
+      break;
+    Offset += Size;
+
+    uint64_t Expected =
+        RecordHeaderSize + alignTo8(SigLength) + (uint64_t)NumOps * 16;
+    StringRef Payload(Rec + RecordHeaderSize, Size - RecordHeaderSize);
+    if (Expected != Size || (uint32_t)xxHash64(Payload) != Checksum)
+      continue;
+
+    std::string Signature(Payload.data(), SigLength);
+
+    Program P;
+    const char *OpData = Payload.data() + alignTo8(SigLength);
+    for (uint32_t i = 0; i < NumOps; i++) {
+      uint64_t Kind = endian::read64le(OpData + i * 16);
+      if (Kind > Op::Xor)
+        break;
+      P.push_back({(Op::OpKind)Kind, endian::read64le(OpData + i * 16 + 8)});
+    }
+
+    if (P.size() != NumOps)
+      continue;
+
+    insert(Signature, P);
+    Loaded++;
+  }
+
+  return true;
+}
+
+void MBAMemo::appendToDatabase(const std::string &Signature,
+                               const Program &P) {
+  using namespace support;
+
+  // Build the whole record first, it is written at once
+  std::string Payload = Signature;
+  Payload.resize(alignTo8(Signature.size()), '\0');
+  for (auto &O : P) {
+    char Buf[16];
+    endian::write64le(Buf, O.Kind);
+    endian::write64le(Buf + 8, O.Value);
+    Payload.append(Buf, sizeof(Buf));
+  }
+
+  char Header[RecordHeaderSize];
+  endian::write32le(Header, RecordHeaderSize + Payload.size());
+  endian::write32le(Header + 4, (uint32_t)xxHash64(Payload));
+  endian::write32le(Header + 8, Signature.size());
+  endian::write32le(Header + 12, P.size());
+
+  std::string Record(Header, sizeof(Header));
+  Record += Payload;
+
+  // The file lock is held per process, threads would both see an empty file
+  // and write the header twice
+  static std::mutex WriterLock;
+  std::lock_guard<std::mutex> Guard(WriterLock);
+
+  int FD;
+  if (auto EC = sys::fs::openFileForWrite(DatabasePath, FD,
+                                          sys::fs::CD_OpenAlways,
+                                          sys::fs::OF_Append)) {
+    errs() << "[!] Could not open the SiMBA database " << DatabasePath << ": "
+           << EC.message() << "\n";
+    return;
+  }
+
+  // Serialize the writers of other processes
+  if (auto EC = sys::fs::lockFile(FD)) {
+    errs() << "[!] Could not lock the SiMBA database: " << EC.message()
+           << "\n";
+    sys::Process::SafelyCloseFileDescriptor(FD);
+    return;
+  }
+
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/false, /*unbuffered=*/true);
+
+    // The first writer creates the header
+    uint64_t Size = 0;
+    sys::fs::file_size(DatabasePath, Size);
+    if (Size == 0)
+      OS.write(DatabaseMagic, sizeof(DatabaseMagic));
+
+    OS.write(Record.data(), Record.size());
+  }
+
+  sys::fs::unlockFile(FD);
+  sys::Process::SafelyCloseFileDescriptor(FD);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/ValueHandle.h>
+
+namespace llvm {
+class Function;
+class Instruction;
+class Value;
+} // namespace llvm
+
+/*
+ * Memo of linear MBA simplifications. A linear MBA is fully determined by its
+ * values on all {0,1} inputs, so the truth-table vector plus the bit width is
+ * a normalized signature: every expression with the same signature can be
+ * replaced by the same simplified form.
+ */
+class MBAMemo {
+public:
+  // Simplified form as a postfix program over the expression variables
+  struct Op {
+    enum OpKind : uint8_t { Var, Const, Add, Sub, Mul, Shl, And, Or, Xor };
+
+    OpKind Kind;
+    uint64_t Value;
+  };
+  typedef std::vector<Op> Program;
+
+  // Expression the memo had no answer for, learned after SiMBA ran
+  struct Candidate {
+    llvm::WeakTrackingVH Root;
+    llvm::Value *OrigRoot;
+    std::vector<llvm::WeakVH> Variables;
+    std::string Signature;
+    unsigned Width;
+  };
+
+  /*
+   * Replace all known linear MBAs of F, unknown ones are returned
+   */
+  int apply(llvm::Function &F, std::vector<Candidate> &Unknown);
+
+  /*
+   * Learn the simplified forms SiMBA produced for the misses
+   */
+  void learn(std::vector<Candidate> &Unknown);
+
+  /*
+   * Functions (by content hash) SiMBA searched without finding an MBA
+   */
+  bool isKnownClean(uint64_t Hash) { return Clean.count(Hash); }
+  void markClean(uint64_t Hash) { Clean.insert(Hash); }
+
+  bool lookup(const std::string &Signature, Program &P);
+  void insert(const std::string &Signature, const Program &P);
+
+  /*
+   * Load the simplifications of an on-disk database and append every newly
+   * learned one to it
+   */
+  bool openDatabase(const std::string &Path);
+  bool hasDatabase() { return !DatabasePath.empty(); }
+
+  int Hits = 0;
+  int Misses = 0;
+  int Learned = 0;
+  int SkippedRuns = 0;
+  int Loaded = 0;
+
+private:
+  std::string DatabasePath;
+
+  void appendToDatabase(const std::string &Signature, const Program &P);
+
+  llvm::StringMap<Program> Memo;
+  std::set<uint64_t> Clean;
+};
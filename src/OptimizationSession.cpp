@@ -0,0 +1,435 @@
+#include "OptimizationSession.h"
+
+#include <optional>
+
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SpeculativeExecution.h"
+#include "llvm/Transforms/Vectorize/VectorCombine.h"
+
+#include "LLVMHelpers.h"
+#include "PipelinePresets.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+/*
+ * Runs the loop stage of the session, registered as 'loop-stage'
+ */
+class LoopStagePass : public PassInfoMixin<LoopStagePass> {
+public:
+  LoopStagePass(OptimizationSession &S) : Session(&S) {}
+
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    return Session->runLoopStage(F, FAM);
+  }
+
+private:
+  OptimizationSession *Session;
+};
+
+// Nested pass managers are not recorded, their passes are
+static bool isPassManager(StringRef PassID) {
+  return PassID.starts_with("PassManager<");
+}
+
+// These create the opportunities for the rest of the pipeline
+static bool isProducerPass(StringRef PassID) {
+  return PassID == SiMBAPass::name() || PassID == InstCombinePass::name();
+}
+
+// Rounds without a change before a pass gets skipped
+static const unsigned AdaptivePatience = 2;
+
+static const Function *getFunction(const Any &IR) {
+  if (const auto *F = llvm::any_cast<const Function *>(&IR)) {
+    return *F;
+  }
+  return nullptr;
+}
+
+OptimizationSession::OptimizationSession(const DeobfuscatorOptions &Options)
+    : PB(nullptr, PipelineTuningOptions(), std::nullopt, &PIC) {
+  LoopStageMaxSize = Options.LoopStageMaxSize;
+  LoopStageTimeBudget = Options.LoopStageTimeBudget;
+  OG.PrintDebug = Options.SiMBADebug;
+  OG.PrintStats = Options.SiMBAStats;
+  OG.Database = Options.SiMBADatabase;
+
+  // Register all the basic analyses with the managers, once per session
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  // Restrict the module pipeline to the scope, if any, and stop once the
+  // watchdog expired
+  PIC.registerShouldRunOptionalPassCallback([this](StringRef, Any IR) {
+    if (WD && WD->expired()) {
+      return false;
+    }
+    return isInScope(IR);
+  });
+
+  registerPasses();
+
+  // Dispatcher loops of flattened control flow, rotate and unswitch them
+  // and fully unroll the ones with a small constant trip count
+  LoopPipeline =
+      "loop-mssa(loop-instsimplify,loop-simplifycfg,licm<allowspeculation>,"
+      "loop-rotate,simple-loop-unswitch<nontrivial;trivial>),"
+      "loop(indvars,loop-deletion,loop-unroll-full),"
+      "loop-unroll<O3;full-unroll-max=" +
+      std::to_string(Options.LoopFullUnrollMax) +
+      ">,"
+      "instcombine<max-iterations=1>";
+  if (auto Err = PB.parsePassPipeline(LoopFPM, LoopPipeline)) {
+    report_fatal_error(std::move(Err));
+  }
+
+  auto Default = findPipelinePreset("squanchy");
+  if (auto Err = setCustomPipeline(Default->Pipeline, true)) {
+    report_fatal_error(std::move(Err));
+  }
+  if (auto Err = setCustomPipeline(Default->PipelineNoCFG, false)) {
+    report_fatal_error(std::move(Err));
+  }
+
+  SimplificationFPM = PB.buildFunctionSimplificationPipeline(
+      OptimizationLevel::O3, ThinOrFullLTOPhase::None);
+
+  MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+}
+
+void OptimizationSession::registerPasses() {
+  PB.registerPipelineParsingCallback(
+      [this](StringRef Name, FunctionPassManager &FPM,
+             ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "loop-stage") {
+          FPM.addPass(LoopStagePass(*this));
+          return true;
+        }
+
+        if (Name == "simba") {
+          FPM.addPass(SiMBAPass(OG));
+          return true;
+        }
+
+        if (Name == "spec-exec<only-if-divergent-target>") {
+          FPM.addPass(SpeculativeExecutionPass(true));
+          return true;
+        }
+
+        if (Name == "vector-combine<early-only>") {
+          FPM.addPass(VectorCombinePass(true));
+          return true;
+        }
+
+        return false;
+      });
+}
+
+Error OptimizationSession::setCustomPipeline(StringRef Pipeline,
+                                             bool SimplifyCFG) {
+  FunctionPassManager FPM;
+  if (auto Err = PB.parsePassPipeline(FPM, Pipeline)) {
+    return Err;
+  }
+
+  if (SimplifyCFG) {
+    CustomFPM = std::move(FPM);
+    CustomPipeline = Pipeline.str();
+    CustomSlots.clear();
+  } else {
+    CustomFPMNoCFG = std::move(FPM);
+    CustomPipelineNoCFG = Pipeline.str();
+    CustomNoCFGSlots.clear();
+  }
+
+  return Error::success();
+}
+
+std::string OptimizationSession::describe() {
+  return "pipeline=" + CustomPipeline + ";pipeline-nocfg=" +
+         CustomPipelineNoCFG + ";loop-stage=" + LoopPipeline +
+         ";loop-stage-max-size=" + std::to_string(LoopStageMaxSize) +
+         ";loop-stage-time-budget=" + std::to_string(LoopStageTimeBudget);
+}
+
+void OptimizationSession::runCustomPipeline(Function &F, bool SimplifyCFG,
+                                            int Iteration) {
+  this->Stage = SimplifyCFG ? "custom" : "custom-nocfg";
+  this->Iteration = Iteration;
+
+  // Only the custom pipelines are scheduled adaptively
+  ActiveSlots = SimplifyCFG ? &CustomSlots : &CustomNoCFGSlots;
+  CurrentSlot = 0;
+  GrantedSlot.reset();
+  RunningSlots.clear();
+
+  if (SimplifyCFG) {
+    CustomFPM.run(F, FAM);
+  } else {
+    CustomFPMNoCFG.run(F, FAM);
+  }
+
+  ActiveSlots = nullptr;
+}
+
+PreservedAnalyses OptimizationSession::runLoopStage(Function &F,
+                                                   FunctionAnalysisManager &FAM) {
+  const char *SkipReason = nullptr;
+  if (LoopStageMaxSize && F.getInstructionCount() > LoopStageMaxSize) {
+    SkipReason = "function too large";
+  } else if (LoopStageTimeBudget &&
+             LoopStageTime >= std::chrono::milliseconds(LoopStageTimeBudget)) {
+    SkipReason = "time budget exhausted";
+  }
+
+  if (SkipReason) {
+    if (!LoopStageReported) {
+      *OG.Log << "[*] Skipping the loop stage of " << F.getName() << ": "
+              << SkipReason << "\n";
+      LoopStageReported = true;
+    }
+    return PreservedAnalyses::all();
+  }
+
+  // The nested passes take a single slot of the adaptive schedule
+  auto *Slots = ActiveSlots;
+  auto OuterStage = Stage;
+  ActiveSlots = nullptr;
+  Stage = "loop-stage";
+
+  auto Start = std::chrono::steady_clock::now();
+  auto PA = LoopFPM.run(F, FAM);
+  LoopStageTime += std::chrono::steady_clock::now() - Start;
+
+  ActiveSlots = Slots;
+  Stage = OuterStage;
+
+  return PA;
+}
+
+void OptimizationSession::runFunctionSimplification(Function &F) {
+  this->Stage = "simplification";
+  this->Iteration = 0;
+
+  SimplificationFPM.run(F, FAM);
+}
+
+void OptimizationSession::runModulePipeline(
+    Module &M, const SmallPtrSetImpl<const Function *> *Scope) {
+  // Functions might have been added or removed since the last run
+  invalidate();
+
+  this->Stage = "module";
+  this->Iteration = 0;
+
+  this->Scope = Scope;
+  MPM.run(M, MAM);
+  this->Scope = nullptr;
+}
+
+bool OptimizationSession::isInScope(const Any &IR) {
+  if (!Scope) {
+    return true;
+  }
+
+  if (auto F = getFunction(IR)) {
+    return Scope->count(F);
+  }
+
+  if (const auto *L = llvm::any_cast<const Loop *>(&IR)) {
+    return Scope->count((*L)->getHeader()->getParent());
+  }
+
+  // Run on a SCC as long as one of its functions is in scope
+  if (const auto *C = llvm::any_cast<const LazyCallGraph::SCC *>(&IR)) {
+    for (auto &N : **C) {
+      if (Scope->count(&N.getFunction())) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  return true;
+}
+
+void OptimizationSession::invalidate(Function &F) {
+  FAM.invalidate(F, PreservedAnalyses::none());
+}
+
+void OptimizationSession::invalidate() {
+  LAM.clear();
+  FAM.clear();
+  CGAM.clear();
+  MAM.clear();
+}
+
+void OptimizationSession::enableProfiling() {
+  if (Profiling) {
+    return;
+  }
+  Profiling = true;
+
+  PIC.registerBeforeNonSkippedPassCallback([this](StringRef PassID, Any IR) {
+    auto F = getFunction(IR);
+    if (!F || isPassManager(PassID)) {
+      return;
+    }
+
+    // Preserved analyses do not prove a pass left the IR alone, hash first
+    // so the pass time does not include the hashing
+    uint64_t Hash = Squanchy::getContentHash(*F);
+    PendingPasses.push_back(
+        {std::chrono::steady_clock::now(), F->getInstructionCount(), Hash});
+  });
+
+  PIC.registerAfterPassCallback([this](StringRef PassID, Any IR,
+                                       const PreservedAnalyses &PA) {
+    auto F = getFunction(IR);
+    if (!F || isPassManager(PassID) || PendingPasses.empty()) {
+      return;
+    }
+
+    auto Pending = PendingPasses.pop_back_val();
+    auto Time = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - Pending.Start);
+    int64_t Before = Pending.Instructions;
+    int64_t After = F->getInstructionCount();
+
+    json::Object Record{{"function", F->getName().str()},
+                        {"stage", Stage},
+                        {"iteration", Iteration},
+                        {"pass", PassID.str()},
+                        {"time_us", (int64_t)Time.count()},
+                        {"instructions_before", Before},
+                        {"instructions_after", After},
+                        {"delta", After - Before},
+                        {"changed",
+                         Pending.Hash != Squanchy::getContentHash(*F)}};
+
+    // Same numbers as the [SiMBA++] stats line
+    if (PassID == SiMBAPass::name()) {
+      Record["simba_mbas"] = OG.LastMBACount;
+      Record["simba_memo"] = OG.LastMemoCount;
+      Record["simba_time_ms"] = OG.LastDurationMs;
+    }
+
+    Profile.push_back(std::move(Record));
+  });
+}
+
+void OptimizationSession::enableAdaptiveScheduling() {
+  if (Adaptive) {
+    return;
+  }
+  Adaptive = true;
+
+  PIC.registerShouldRunOptionalPassCallback([this](StringRef PassID, Any IR) {
+    if (!ActiveSlots || !getFunction(IR) || isPassManager(PassID)) {
+      return true;
+    }
+
+    unsigned Slot = CurrentSlot++;
+    if (Slot >= ActiveSlots->size()) {
+      ActiveSlots->resize(Slot + 1);
+    }
+
+    if ((*ActiveSlots)[Slot].Skipped) {
+      SkippedPassRuns++;
+      return false;
+    }
+    GrantedSlot = Slot;
+    return true;
+  });
+
+  // Required passes are never asked whether they should run, only charge
+  // the passes that were granted a slot
+  PIC.registerBeforeNonSkippedPassCallback([this](StringRef PassID, Any IR) {
+    auto F = getFunction(IR);
+    if (!ActiveSlots || !F || isPassManager(PassID)) {
+      return;
+    }
+
+    // Preserved analyses do not prove a pass left the IR alone
+    RunningSlot Running{GrantedSlot, std::nullopt};
+    if (GrantedSlot || isProducerPass(PassID)) {
+      Running.Hash = Squanchy::getContentHash(*F);
+    }
+    RunningSlots.push_back(Running);
+    GrantedSlot.reset();
+  });
+
+  PIC.registerAfterPassCallback([this](StringRef PassID, Any IR,
+                                       const PreservedAnalyses &PA) {
+    auto F = getFunction(IR);
+    if (!ActiveSlots || !F || isPassManager(PassID) || RunningSlots.empty()) {
+      return;
+    }
+
+    auto Running = RunningSlots.pop_back_val();
+    if (!Running.Hash) {
+      return;
+    }
+    bool Changed = *Running.Hash != Squanchy::getContentHash(*F);
+
+    // The producers are never skipped, their changes give every other
+    // pass new work
+    if (isProducerPass(PassID)) {
+      if (Changed) {
+        wakeSlots(*ActiveSlots);
+      }
+      return;
+    }
+
+    auto &Slot = (*ActiveSlots)[*Running.Slot];
+    if (Changed) {
+      Slot.IdleRounds = 0;
+    } else if (++Slot.IdleRounds >= AdaptivePatience) {
+      Slot.Skipped = true;
+    }
+  });
+}
+
+void OptimizationSession::resetSchedule() {
+  CustomSlots.clear();
+  CustomNoCFGSlots.clear();
+
+  // The loop stage budget is spent per fixpoint
+  LoopStageTime = std::chrono::steady_clock::duration::zero();
+  LoopStageReported = false;
+}
+
+bool OptimizationSession::wakeAllPasses() {
+  bool WasSkipping = false;
+  for (auto *Slots : {&CustomSlots, &CustomNoCFGSlots}) {
+    for (auto &Slot : *Slots) {
+      WasSkipping |= Slot.Skipped;
+    }
+    wakeSlots(*Slots);
+  }
+  return WasSkipping;
+}
+
+void OptimizationSession::wakeSlots(std::vector<PassSlot> &Slots) {
+  for (auto &Slot : Slots) {
+    Slot.IdleRounds = 0;
+    Slot.Skipped = false;
+  }
+}
+
+void OptimizationSession::appendProfile(json::Array &&Records) {
+  for (auto &R : Records) {
+    Profile.push_back(std::move(R));
+  }
+}
+
+} // namespace squanchy
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/JSON.h>
+
+#include "DeobfuscatorOptions.h"
+#include "SiMBAPass.h"
+#include "Watchdog.h"
+
+namespace squanchy {
+
+class LoopStagePass;
+
+/*
+ * Owns the pass builder, the analysis managers and the pipelines used while
+ * deobfuscating one module. Pipelines are built once and the cached analyses
+ * stay valid across runs, changes done outside of a pass manager have to be
+ * announced with invalidate().
+ */
+class OptimizationSession {
+public:
+  /*
+   * Uses the loop stage limits of Options, the custom pipelines start out
+   * as the squanchy preset
+   */
+  OptimizationSession(const DeobfuscatorOptions &Options);
+
+  OptimizationSession(const OptimizationSession &) = delete;
+  OptimizationSession &operator=(const OptimizationSession &) = delete;
+
+  /*
+   * Replace the custom pipeline with a textual pass pipeline. SimplifyCFG
+   * selects the variant that may change the CFG.
+   */
+  llvm::Error setCustomPipeline(llvm::StringRef Pipeline, bool SimplifyCFG);
+
+  const std::string &getCustomPipeline(bool SimplifyCFG) {
+    return SimplifyCFG ? CustomPipeline : CustomPipelineNoCFG;
+  }
+
+  /*
+   * Everything that changes what the custom pipelines do, used in cache keys
+   */
+  std::string describe();
+
+  /*
+   * Run the custom deobfuscation pipeline once over F, Iteration is the
+   * fixpoint round recorded in the pass profile
+   */
+  void runCustomPipeline(llvm::Function &F, bool SimplifyCFG,
+                         int Iteration = 0);
+
+  /*
+   * Run the O3 function simplification pipeline over F
+   */
+  void runFunctionSimplification(llvm::Function &F);
+
+  /*
+   * Run the O3 module pipeline over M. With a Scope, function, loop and
+   * CGSCC passes only run on the functions in it, module passes still see
+   * the whole module.
+   */
+  void runModulePipeline(
+      llvm::Module &M,
+      const llvm::SmallPtrSetImpl<const llvm::Function *> *Scope = nullptr);
+
+  /*
+   * Drop the cached analyses of F after it was changed outside a pipeline
+   */
+  void invalidate(llvm::Function &F);
+
+  /*
+   * Drop all cached analyses after functions were added or removed
+   */
+  void invalidate();
+
+  /*
+   * Skip passes of the custom pipeline that did not change the function in
+   * the last rounds, until SiMBA or InstCombine change it again
+   */
+  void enableAdaptiveScheduling();
+
+  /*
+   * Forget the pass history and the spent loop stage budget, called before a
+   * new fixpoint starts
+   */
+  void resetSchedule();
+
+  /*
+   * Run every pass again in the next round, returns false if no pass was
+   * being skipped
+   */
+  bool wakeAllPasses();
+
+  unsigned getSkippedPassRuns() { return SkippedPassRuns; }
+
+  /*
+   * Record time, instruction delta and change flag of every function pass
+   * invocation from now on
+   */
+  void enableProfiling();
+
+  /*
+   * Hand out the records collected so far
+   */
+  llvm::json::Array takeProfile() { return std::move(Profile); }
+  void appendProfile(llvm::json::Array &&Records);
+
+  /*
+   * Skip all remaining optional passes once the watchdog expired
+   */
+  void setWatchdog(Watchdog *WD) {
+    this->WD = WD;
+    OG.WD = WD;
+  }
+
+  /*
+   * Print the messages of the session and of SiMBA to OS
+   */
+  void setLog(llvm::raw_ostream &OS) { OG.Log = &OS; }
+
+  OptimizationGuide &getGuide() { return OG; }
+
+private:
+  friend class LoopStagePass;
+
+  OptimizationGuide OG;
+
+  // Referenced by the pass builder, has to outlive it
+  llvm::PassInstrumentationCallbacks PIC;
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+
+  llvm::PassBuilder PB;
+
+  llvm::FunctionPassManager CustomFPM;
+  llvm::FunctionPassManager CustomFPMNoCFG;
+  std::string CustomPipeline = "";
+  std::string CustomPipelineNoCFG = "";
+
+  // Loop stage of the custom pipeline and its budget for the current
+  // function
+  llvm::FunctionPassManager LoopFPM;
+  std::string LoopPipeline = "";
+  unsigned LoopStageMaxSize = 0;
+  unsigned LoopStageTimeBudget = 0;
+  std::chrono::steady_clock::duration LoopStageTime =
+      std::chrono::steady_clock::duration::zero();
+  bool LoopStageReported = false;
+
+  llvm::PreservedAnalyses runLoopStage(llvm::Function &F,
+                                       llvm::FunctionAnalysisManager &FAM);
+  llvm::FunctionPassManager SimplificationFPM;
+  llvm::ModulePassManager MPM;
+
+  /*
+   * Make the squanchy passes available to the pipeline parser
+   */
+  void registerPasses();
+
+  Watchdog *WD = nullptr;
+
+  // Functions the module pipeline may optimize, all if not set
+  const llvm::SmallPtrSetImpl<const llvm::Function *> *Scope = nullptr;
+
+  bool isInScope(const llvm::Any &IR);
+
+  // Pass profile state
+  struct PendingPass {
+    std::chrono::steady_clock::time_point Start;
+    unsigned Instructions;
+    uint64_t Hash;
+  };
+
+  bool Profiling = false;
+  std::string Stage = "";
+  int Iteration = 0;
+  llvm::SmallVector<PendingPass, 4> PendingPasses;
+  llvm::json::Array Profile;
+
+  // Adaptive scheduling state, one slot per pass position in the pipeline
+  struct PassSlot {
+    unsigned IdleRounds = 0;
+    bool Skipped = false;
+  };
+
+  bool Adaptive = false;
+  std::vector<PassSlot> CustomSlots;
+  std::vector<PassSlot> CustomNoCFGSlots;
+  std::vector<PassSlot> *ActiveSlots = nullptr;
+  unsigned CurrentSlot = 0;
+
+  // Slot granted to the next pass and the slots of the running passes,
+  // required passes run without one. Hash is the function before the pass,
+  // only taken for passes whose changes are tracked
+  struct RunningSlot {
+    std::optional<unsigned> Slot;
+    std::optional<uint64_t> Hash;
+  };
+  std::optional<unsigned> GrantedSlot;
+  llvm::SmallVector<RunningSlot, 4> RunningSlots;
+  unsigned SkippedPassRuns = 0;
+
+  void wakeSlots(std::vector<PassSlot> &Slots);
+};
+
+} // namespace squanchy
@@ -0,0 +1,151 @@
+#include "PipelinePresets.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+// The custom pipeline follows the function simplification pipeline
+// https://github.com/llvm/llvm-project/blob/64075837b5532108a1fe96a5b158feb7a9025694/llvm/lib/Passes/PassBuilderPipelines.cpp#L545
+// with SiMBA at both ends. 'simba', 'loop-stage',
+// 'spec-exec<only-if-divergent-target>' and 'vector-combine<early-only>' are
+// registered by the OptimizationSession. The loop stage changes the CFG and
+// is left out of the nocfg variants.
+#define SQUANCHY_PIPELINE_HEAD                                                 \
+  "simba,"                                                                     \
+  "ee-instrument,"                                                             \
+  "lower-expect,"
+
+#define SQUANCHY_PIPELINE_EARLY                                                \
+  "sroa<preserve-cfg>,"                                                        \
+  "early-cse,"                                                                 \
+  "callsite-splitting,"                                                        \
+  "float2int,"                                                                 \
+  "inject-tli-mappings,"                                                       \
+  "sroa<preserve-cfg>,"                                                        \
+  "early-cse<memssa>,"
+
+#define SQUANCHY_PIPELINE_TAIL(GVN)                                            \
+  "sroa<preserve-cfg>,"                                                        \
+  "vector-combine<early-only>,"                                                \
+  "mldst-motion," GVN ","                                                      \
+  "sccp,"                                                                      \
+  "bdce,"                                                                      \
+  "instcombine<max-iterations=1>,"                                             \
+  "jump-threading,"                                                            \
+  "correlated-propagation,"                                                    \
+  "adce,"                                                                      \
+  "memcpyopt,"                                                                 \
+  "dse,"                                                                       \
+  "move-auto-init,"                                                            \
+  "coro-elide,"                                                                \
+  "simplifycfg<switch-range-to-icmp;hoist-common-insts;sink-common-insts>,"    \
+  "instcombine<max-iterations=1>,"                                             \
+  "simba"
+
+#define SQUANCHY_PIPELINE(GVN)                                                 \
+  SQUANCHY_PIPELINE_HEAD                                                       \
+  "simplifycfg," SQUANCHY_PIPELINE_EARLY "gvn-hoist,"                          \
+  "gvn-sink,"                                                                  \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "spec-exec<only-if-divergent-target>,"                                       \
+  "jump-threading,"                                                            \
+  "correlated-propagation,"                                                    \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "instcombine<max-iterations=1>,"                                             \
+  "aggressive-instcombine,"                                                    \
+  "libcalls-shrinkwrap,"                                                       \
+  "tailcallelim,"                                                              \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "reassociate,"                                                               \
+  "constraint-elimination,"                                                    \
+  "loop-stage,"                                                                \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "instcombine<max-iterations=1>," SQUANCHY_PIPELINE_TAIL(GVN)
+
+#define SQUANCHY_PIPELINE_NOCFG(GVN)                                           \
+  SQUANCHY_PIPELINE_HEAD SQUANCHY_PIPELINE_EARLY "gvn-hoist,"                  \
+  "spec-exec<only-if-divergent-target>,"                                       \
+  "jump-threading,"                                                            \
+  "correlated-propagation,"                                                    \
+  "instcombine<max-iterations=1>,"                                             \
+  "aggressive-instcombine,"                                                    \
+  "libcalls-shrinkwrap,"                                                       \
+  "tailcallelim,"                                                              \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "reassociate,"                                                               \
+  "constraint-elimination,"                                                    \
+  "instcombine<max-iterations=1>," SQUANCHY_PIPELINE_TAIL(GVN)
+
+// Only the passes that fold the MBA and opaque predicate leftovers
+#define SQUANCHY_PIPELINE_FAST(CFG)                                            \
+  "simba," CFG "sroa<preserve-cfg>,"                                           \
+  "early-cse<memssa>,"                                                         \
+  "instcombine<max-iterations=1>,"                                             \
+  "correlated-propagation,"                                                    \
+  "sccp,"                                                                      \
+  "gvn,"                                                                       \
+  "instcombine<max-iterations=1>,"                                             \
+  "adce,"                                                                      \
+  "dse,"                                                                       \
+  "simplifycfg<switch-range-to-icmp>,"                                         \
+  "simba"
+
+static const PipelinePreset Presets[] = {
+    {"squanchy", "Default deobfuscation pipeline", SQUANCHY_PIPELINE("gvn"),
+     SQUANCHY_PIPELINE_NOCFG("gvn")},
+    {"squanchy-newgvn", "Default pipeline with NewGVN instead of GVN",
+     SQUANCHY_PIPELINE("newgvn"), SQUANCHY_PIPELINE_NOCFG("newgvn")},
+    {"squanchy-fast", "Short pipeline for quick experiments",
+     SQUANCHY_PIPELINE_FAST("simplifycfg,jump-threading,"),
+     SQUANCHY_PIPELINE_FAST("")},
+};
+
+ArrayRef<PipelinePreset> getPipelinePresets() { return Presets; }
+
+const PipelinePreset *findPipelinePreset(StringRef Name) {
+  for (auto &P : Presets) {
+    if (Name == P.Name) {
+      return &P;
+    }
+  }
+  return nullptr;
+}
+
+std::string resolvePipeline(StringRef Value, bool SimplifyCFG) {
+  if (auto P = findPipelinePreset(Value)) {
+    return SimplifyCFG ? P->Pipeline : P->PipelineNoCFG;
+  }
+
+  if (!sys::fs::is_regular_file(Value)) {
+    return Value.str();
+  }
+
+  auto Buffer = MemoryBuffer::getFile(Value);
+  if (!Buffer) {
+    return Value.str();
+  }
+
+  // One or more passes per line
+  std::string Pipeline;
+  SmallVector<StringRef, 64> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n');
+  for (auto Line : Lines) {
+    Line = Line.split('#').first.trim().trim(',');
+    if (Line.empty()) {
+      continue;
+    }
+
+    if (!Pipeline.empty()) {
+      Pipeline += ",";
+    }
+    Pipeline += Line.str();
+  }
+
+  return Pipeline;
+}
+
+} // namespace squanchy
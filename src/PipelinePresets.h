@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+
+namespace squanchy {
+
+/*
+ * A named custom pipeline shipped with squanchy. Every preset has a variant
+ * for the first fixpoint which keeps the CFG intact.
+ */
+struct PipelinePreset {
+  const char *Name;
+  const char *Description;
+  const char *Pipeline;
+  const char *PipelineNoCFG;
+};
+
+llvm::ArrayRef<PipelinePreset> getPipelinePresets();
+
+const PipelinePreset *findPipelinePreset(llvm::StringRef Name);
+
+/*
+ * Turn a -pipeline value into a pass pipeline string. The value is either a
+ * preset name, a file with one pass per line ('#' starts a comment) or a
+ * pipeline string that is returned as is.
+ */
+std::string resolvePipeline(llvm::StringRef Value, bool SimplifyCFG);
+
+} // namespace squanchy
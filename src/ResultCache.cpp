@@ -0,0 +1,202 @@
+#include "ResultCache.h"
+
+#include <set>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "LLVMHelpers.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+// Bump when the layout of the entries changes
+static const char *CacheVersion = "squanchy-cache-v2";
+
+ResultCache::ResultCache(const std::string &Directory) : Directory(Directory) {
+  if (auto EC = sys::fs::create_directories(Directory)) {
+    errs() << "[!] Could not create the cache directory " << Directory << ": "
+           << EC.message() << "\n";
+  }
+}
+
+// Collect the globals referenced by a value, looking through constant
+// expressions
+static void collectGlobals(const Value *V, std::vector<const GlobalValue *> &GVs,
+                           std::set<const Value *> &Visited) {
+  if (!Visited.insert(V).second)
+    return;
+
+  if (auto *GV = dyn_cast<GlobalValue>(V)) {
+    GVs.push_back(GV);
+    return;
+  }
+
+  if (auto *C = dyn_cast<Constant>(V)) {
+    for (auto &Op : C->operands()) {
+      collectGlobals(Op, GVs, Visited);
+    }
+  }
+}
+
+std::string ResultCache::fingerprint(Function *F) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+
+  OS << CacheVersion;
+
+  // Walk all definitions and initializers reachable from F in a stable order
+  std::vector<const GlobalValue *> Worklist = {F};
+  std::set<const GlobalValue *> Seen = {F};
+  while (!Worklist.empty()) {
+    auto Global = Worklist.back();
+    Worklist.pop_back();
+
+    std::vector<const GlobalValue *> GVs;
+    std::set<const Value *> Visited;
+    if (auto Fn = dyn_cast<Function>(Global)) {
+      OS << ";" << format_hex(Squanchy::getContentHash(*Fn), 18);
+
+      for (auto &I : instructions(Fn)) {
+        for (auto &Op : I.operands()) {
+          collectGlobals(Op, GVs, Visited);
+        }
+      }
+    } else {
+      // Data segments and constant tables fold into the result
+      auto GVar = cast<GlobalVariable>(Global);
+      OS << ";" << GVar->getName() << "=" << GVar->isConstant()
+         << format_hex(Squanchy::getContentHash(*GVar->getInitializer()), 18);
+
+      collectGlobals(GVar->getInitializer(), GVs, Visited);
+    }
+
+    // The cached body binds to its globals by name
+    for (auto GV : GVs) {
+      OS << "," << GV->getName();
+
+      auto CF = dyn_cast<Function>(GV);
+      auto CV = dyn_cast<GlobalVariable>(GV);
+      bool HasContent =
+          (CF && !CF->isDeclaration()) || (CV && CV->hasInitializer());
+      if (HasContent && Seen.insert(GV).second) {
+        Worklist.push_back(GV);
+      }
+    }
+  }
+
+  OS.flush();
+  return Str;
+}
+
+std::string ResultCache::getPath(const std::string &Key) {
+  SmallString<128> Path(Directory);
+  sys::path::append(Path, utohexstr(xxHash64(Key), false, 16) + ".bc");
+  return std::string(Path);
+}
+
+std::unique_ptr<Module> ResultCache::lookup(const std::string &Key,
+                                            LLVMContext &Context) {
+  auto Buffer = MemoryBuffer::getFile(getPath(Key));
+  if (!Buffer) {
+    Misses++;
+    return nullptr;
+  }
+
+  auto Cached = parseBitcodeFile((*Buffer)->getMemBufferRef(), Context);
+  if (!Cached) {
+    errs() << "[!] Ignoring broken cache entry " << getPath(Key) << ": "
+           << toString(Cached.takeError()) << "\n";
+    Misses++;
+    return nullptr;
+  }
+
+  // Guard against collisions of the file name hash
+  if ((*Cached)->getSourceFileName() != Key) {
+    Misses++;
+    return nullptr;
+  }
+
+  Hits++;
+  return std::move(*Cached);
+}
+
+void ResultCache::store(const std::string &Key, Function *F) {
+  // Only the body of F is kept, local globals it uses are copied along
+  std::set<const GlobalValue *> Locals;
+  {
+    std::vector<const GlobalValue *> GVs;
+    std::set<const Value *> Visited;
+    for (auto &I : instructions(F)) {
+      for (auto &Op : I.operands()) {
+        collectGlobals(Op, GVs, Visited);
+      }
+    }
+    for (auto GV : GVs) {
+      if (isa<GlobalVariable>(GV) && GV->hasLocalLinkage()) {
+        Locals.insert(GV);
+      }
+    }
+  }
+
+  ValueToValueMapTy VMap;
+  auto Entry = CloneModule(*F->getParent(), VMap, [&](const GlobalValue *GV) {
+    return GV == F || Locals.count(GV);
+  });
+  Entry->setSourceFileName(Key);
+
+  // Drop everything the body does not need
+  Value *EntryF = VMap[F];
+  bool Changed;
+  do {
+    Changed = false;
+    for (auto &GV : llvm::make_early_inc_range(Entry->global_values())) {
+      if (GV.use_empty() && &GV != EntryF) {
+        GV.eraseFromParent();
+        Changed = true;
+      }
+    }
+  } while (Changed);
+
+  // Write to a temporary file first, readers never see partial entries
+  std::string Path = getPath(Key);
+  std::string TmpPath =
+      Path + ".tmp" + std::to_string(sys::Process::getProcessId()) + "." +
+      utohexstr((uintptr_t)F);
+
+  {
+    std::error_code EC;
+    raw_fd_ostream OS(TmpPath, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "[!] Could not write the cache entry " << TmpPath << ": "
+             << EC.message() << "\n";
+      return;
+    }
+
+    WriteBitcodeToFile(*Entry, OS);
+  }
+
+  if (auto EC = sys::fs::rename(TmpPath, Path)) {
+    errs() << "[!] Could not store the cache entry " << Path << ": "
+           << EC.message() << "\n";
+    sys::fs::remove(TmpPath);
+  }
+}
+
+} // namespace squanchy
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace llvm {
+class Function;
+class LLVMContext;
+class Module;
+} // namespace llvm
+
+namespace squanchy {
+
+/*
+ * On-disk cache of deobfuscated function bodies. Entries are bitcode
+ * modules holding one function definition and are addressed by a key
+ * derived from the function before deobfuscation.
+ */
+class ResultCache {
+public:
+  ResultCache(const std::string &Directory);
+
+  /*
+   * Fingerprint of F and everything it can inline: the content hash of all
+   * reachable definitions plus the names and initializers of the globals
+   * they reference
+   */
+  static std::string fingerprint(llvm::Function *F);
+
+  /*
+   * Load the cached module for Key, nullptr on a miss
+   */
+  std::unique_ptr<llvm::Module> lookup(const std::string &Key,
+                                       llvm::LLVMContext &Context);
+
+  /*
+   * Store the body of F under Key
+   */
+  void store(const std::string &Key, llvm::Function *F);
+
+  int getHits() { return Hits; }
+  int getMisses() { return Misses; }
+
+  /*
+   * Count the lookups of a cache used by a slice worker
+   */
+  void addStats(int Hits, int Misses) {
+    this->Hits += Hits;
+    this->Misses += Misses;
+  }
+
+private:
+  std::string Directory;
+
+  int Hits = 0;
+  int Misses = 0;
+
+  std::string getPath(const std::string &Key);
+};
+
+} // namespace squanchy
@@ -0,0 +1,371 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Deobfuscator.h"
+#include "SquanchyOptions.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+namespace {
+
+// Exclusive while the command line is parsed and while requests run that
+// change process wide state, shared by all other running requests
+std::shared_mutex OptionsLock;
+
+/*
+ * Log of one request. Complete lines go to stdout under a lock shared by
+ * all requests, so concurrent requests never tear each other's lines.
+ */
+class RequestLog : public raw_ostream {
+public:
+  RequestLog() { SetUnbuffered(); }
+  ~RequestLog() override {
+    if (!Pending.empty()) {
+      Pending += "\n";
+      writeLines(Pending.size());
+    }
+  }
+
+private:
+  static std::mutex OutputLock;
+  std::string Pending;
+  uint64_t Position = 0;
+
+  void write_impl(const char *Ptr, size_t Size) override {
+    Pending.append(Ptr, Size);
+    Position += Size;
+
+    auto End = Pending.rfind('\n');
+    if (End != std::string::npos) {
+      writeLines(End + 1);
+    }
+  }
+
+  uint64_t current_pos() const override { return Position; }
+
+  void writeLines(size_t Size) {
+    std::lock_guard<std::mutex> Guard(OutputLock);
+    outs() << StringRef(Pending).take_front(Size);
+    outs().flush();
+    Pending.erase(0, Size);
+  }
+};
+
+std::mutex RequestLog::OutputLock;
+
+class Connection {
+public:
+  Connection(int Fd, const std::vector<std::string> &BaseArgs)
+      : Fd(Fd), BaseArgs(BaseArgs) {}
+
+  ~Connection() { close(Fd); }
+
+  void run();
+
+private:
+  int Fd;
+  const std::vector<std::string> &BaseArgs;
+
+  bool send(json::Object Response);
+  void handle(StringRef Line);
+  bool parseOptions(const std::vector<std::string> &Options,
+                    std::string &Error);
+  void restoreOptions();
+  void deobfuscate(json::Value Id, const std::string &Input,
+                   const std::string &Output, DeobfuscatorOptions Options);
+};
+
+bool Connection::send(json::Object Response) {
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << json::Value(std::move(Response)) << "\n";
+  OS.flush();
+
+  // A client going away must not kill the daemon with SIGPIPE
+  size_t Written = 0;
+  while (Written < Line.size()) {
+    auto Result = ::send(Fd, Line.data() + Written, Line.size() - Written,
+                         MSG_NOSIGNAL);
+    if (Result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Result <= 0) {
+      return false;
+    }
+    Written += Result;
+  }
+
+  return true;
+}
+
+bool Connection::parseOptions(const std::vector<std::string> &Options,
+                              std::string &Error) {
+  std::vector<const char *> Argv;
+  for (auto &Arg : BaseArgs) {
+    Argv.push_back(Arg.c_str());
+  }
+  for (auto &Arg : Options) {
+    Argv.push_back(Arg.c_str());
+  }
+
+  raw_string_ostream OS(Error);
+  cl::ResetAllOptionOccurrences();
+  bool Success =
+      cl::ParseCommandLineOptions(Argv.size(), Argv.data(), "", &OS);
+  OS.flush();
+  return Success;
+}
+
+void Connection::restoreOptions() {
+  std::string Error;
+  if (!parseOptions({}, Error)) {
+    errs() << "[!] Could not restore the daemon options: " << Error << "\n";
+  }
+}
+
+void Connection::deobfuscate(json::Value Id, const std::string &Input,
+                             const std::string &Output,
+                             DeobfuscatorOptions Options) {
+  auto Start = std::chrono::steady_clock::now();
+
+  RequestLog Log;
+  Deobfuscator D(Input, Output, std::move(Options));
+  if (!D.isLoaded()) {
+    send(json::Object{{"id", Id},
+                      {"event", "done"},
+                      {"success", false},
+                      {"error", "could not load " + Input}});
+    return;
+  }
+  D.setLog(Log);
+
+  // Stream the functions back as they finish
+  D.setFunctionCallback([&](const FunctionResult &Result) {
+    json::Object Response{{"id", Id},
+                          {"event", "function"},
+                          {"name", Result.Name},
+                          {"success", Result.Success},
+                          {"before", Result.InstructionsBefore},
+                          {"after", Result.InstructionsAfter},
+                          {"ms", Result.Milliseconds}};
+    if (!Result.Error.empty()) {
+      Response["error"] = Result.Error;
+    }
+    send(std::move(Response));
+  });
+
+  bool Success = D.deobfuscate();
+  auto Ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - Start)
+                .count();
+
+  json::Object Done{{"id", Id},
+                    {"event", "done"},
+                    {"success", Success},
+                    {"before", D.getInstructionCountBefore()},
+                    {"after", D.getInstructionCountAfter()},
+                    {"ms", Ms}};
+  if (!Output.empty()) {
+    Done["output"] = Output;
+  }
+  send(std::move(Done));
+}
+
+void Connection::handle(StringRef Line) {
+  auto Request = json::parse(Line);
+  if (!Request) {
+    send(json::Object{{"event", "done"},
+                      {"success", false},
+                      {"error", toString(Request.takeError())}});
+    return;
+  }
+
+  auto Object = Request->getAsObject();
+  json::Value Id = nullptr;
+  if (Object && Object->get("id")) {
+    Id = *Object->get("id");
+  }
+
+  auto fail = [&](const std::string &Error) {
+    send(json::Object{
+        {"id", Id}, {"event", "done"}, {"success", false}, {"error", Error}});
+  };
+
+  auto Input = Object ? Object->getString("input") : std::nullopt;
+  auto FunctionList = Object ? Object->getArray("functions") : nullptr;
+  if (!Input || !FunctionList || FunctionList->empty()) {
+    fail("a request needs an input and a non-empty function list");
+    return;
+  }
+
+  std::vector<std::string> Functions;
+  for (auto &Function : *FunctionList) {
+    auto Name = Function.getAsString();
+    if (!Name) {
+      fail("function names must be strings");
+      return;
+    }
+    Functions.push_back(Name->str());
+  }
+
+  std::vector<std::string> Options;
+  if (auto OptionList = Object->getArray("options")) {
+    for (auto &Option : *OptionList) {
+      auto Arg = Option.getAsString();
+      if (!Arg) {
+        fail("options must be strings");
+        return;
+      }
+      Options.push_back(Arg->str());
+    }
+  }
+
+  std::string Output;
+  if (auto Path = Object->getString("output")) {
+    Output = Path->str();
+  }
+
+  // Turn the request options into DeobfuscatorOptions. Requests without
+  // options only read the daemon's command line.
+  DeobfuscatorOptions RequestOptions;
+  if (Options.empty()) {
+    std::shared_lock<std::shared_mutex> Shared(OptionsLock);
+    RequestOptions = getDeobfuscatorOptions(BaseArgs);
+  } else {
+    // The command line is process wide, nothing may run while it is parsed
+    std::unique_lock<std::shared_mutex> Exclusive(OptionsLock);
+    std::string Error;
+    if (!parseOptions(Options, Error)) {
+      restoreOptions();
+      fail("invalid options: " + Error);
+      return;
+    }
+
+    std::vector<std::string> Args = BaseArgs;
+    Args.insert(Args.end(), Options.begin(), Options.end());
+    RequestOptions = getDeobfuscatorOptions(Args);
+
+    // LLVM and llvm-extract options only exist on the command line, keep it
+    // until the request is done
+    if (!llvm::all_of(Options, isDeobfuscatorOption)) {
+      RequestOptions.Functions = std::move(Functions);
+      deobfuscate(std::move(Id), Input->str(), Output,
+                  std::move(RequestOptions));
+      restoreOptions();
+      return;
+    }
+
+    restoreOptions();
+  }
+  RequestOptions.Functions = std::move(Functions);
+
+  // Everything else runs concurrently, unless it changes process wide state
+  if (RequestOptions.usesProcessWideState()) {
+    std::unique_lock<std::shared_mutex> Exclusive(OptionsLock);
+    deobfuscate(std::move(Id), Input->str(), Output,
+                std::move(RequestOptions));
+    return;
+  }
+
+  std::shared_lock<std::shared_mutex> Shared(OptionsLock);
+  deobfuscate(std::move(Id), Input->str(), Output, std::move(RequestOptions));
+}
+
+void Connection::run() {
+  std::string Buffer;
+  char Chunk[4096];
+
+  while (true) {
+    auto Read = recv(Fd, Chunk, sizeof(Chunk), 0);
+    if (Read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Read <= 0) {
+      return;
+    }
+    Buffer.append(Chunk, Read);
+
+    // Handle every complete line
+    size_t Pos;
+    while ((Pos = Buffer.find('\n')) != std::string::npos) {
+      auto Line = StringRef(Buffer).take_front(Pos).trim();
+      if (!Line.empty()) {
+        handle(Line);
+      }
+      Buffer.erase(0, Pos + 1);
+    }
+  }
+}
+
+} // namespace
+
+int serve(const std::string &SocketPath,
+          const std::vector<std::string> &BaseArgs) {
+  sockaddr_un Addr = {};
+  Addr.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+    errs() << "[!] The socket path is too long: " << SocketPath << "\n";
+    return 1;
+  }
+  strncpy(Addr.sun_path, SocketPath.c_str(), sizeof(Addr.sun_path) - 1);
+
+  // Replace the socket of a previous daemon, but nothing else
+  struct stat Status;
+  if (stat(SocketPath.c_str(), &Status) == 0 && S_ISSOCK(Status.st_mode)) {
+    unlink(SocketPath.c_str());
+  }
+
+  int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (Fd < 0 || bind(Fd, (sockaddr *)&Addr, sizeof(Addr)) < 0 ||
+      listen(Fd, 64) < 0) {
+    errs() << "[!] Could not listen on " << SocketPath << ": "
+           << strerror(errno) << "\n";
+    if (Fd >= 0) {
+      close(Fd);
+    }
+    return 1;
+  }
+
+  // The requests log through RequestLog from here on
+  outs() << "[*] Listening on " << SocketPath << "\n";
+  outs().flush();
+
+  while (true) {
+    int Client = accept(Fd, nullptr, nullptr);
+    if (Client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      errs() << "[!] Could not accept a connection: " << strerror(errno)
+             << "\n";
+      break;
+    }
+
+    std::thread([Client, &BaseArgs]() {
+      Connection(Client, BaseArgs).run();
+    }).detach();
+  }
+
+  close(Fd);
+  return 1;
+}
+
+} // namespace squanchy
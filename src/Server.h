@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace squanchy {
+
+/*
+ * Serve deobfuscation requests on a Unix socket until the process is
+ * killed. Every connection sends one JSON request per line:
+ *
+ *   {"id": 1, "input": "a.wasm", "functions": ["w2c_squanchy_f1"],
+ *    "output": "a.ll", "options": ["-O=2", "-pipeline=squanchy-fast"]}
+ *
+ * and receives one JSON line per finished function followed by a "done"
+ * line with the totals. Connections are served concurrently. The options
+ * are parsed like the command line and restored to BaseArgs afterwards,
+ * requests with LLVM options or process wide limits run alone.
+ */
+int serve(const std::string &SocketPath,
+          const std::vector<std::string> &BaseArgs);
+
+} // namespace squanchy
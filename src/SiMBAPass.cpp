@@ -1,27 +1,76 @@
 #include "SiMBAPass.h"
 
 #include <chrono>
+#include <mutex>
+
+#include <z3.h>
 
 #include "llvm/IR/Function.h"
 #include "llvm/Pass.h"
-#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 
 #include "../dependencies/SiMBA-/LLVMParser.h"
 
+#include "LLVMHelpers.h"
+#include "Watchdog.h"
+
 using namespace std;
 using namespace llvm;
 using namespace std::chrono;
 
-cl::opt<bool> PrintMBADebug("simba-debug", cl::Optional,
-                            cl::desc("Print SiMBA debug output"),
-                            cl::value_desc("simba-debug"), cl::init(false));
+namespace {
+
+/*
+ * Z3's timeout is process wide. Every run sets the time its function has
+ * left, the last run to finish restores the value found by the first one.
+ */
+class SolverTimeout {
+public:
+  SolverTimeout(unsigned Ms) : Active(Ms != 0) {
+    if (!Active) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Users++ == 0) {
+      // Z3's default is no timeout, the largest unsigned value
+      Z3_string Previous = nullptr;
+      if (!Z3_global_param_get("timeout", &Previous) || !Previous) {
+        Previous = "4294967295";
+      }
+      Saved = Previous;
+    }
+    Z3_global_param_set("timeout", std::to_string(Ms).c_str());
+  }
+
+  ~SolverTimeout() {
+    if (!Active) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (--Users == 0) {
+      Z3_global_param_set("timeout", Saved.c_str());
+    }
+  }
+
+  bool isActive() { return Active; }
+
+private:
+  bool Active;
+
+  static std::mutex Lock;
+  static unsigned Users;
+  static std::string Saved;
+};
 
-cl::opt<bool> SiMBAStats("simba-stats", cl::Optional,
-                         cl::desc("Print SiMBA stats"),
-                         cl::value_desc("simba-stats"), cl::init(true));
+std::mutex SolverTimeout::Lock;
+unsigned SolverTimeout::Users = 0;
+std::string SolverTimeout::Saved = "";
+
+} // namespace
 
 PreservedAnalyses SiMBAPass::run(Function &F, FunctionAnalysisManager &FAM) {
   if (F.isDeclaration())
@@ -30,22 +79,63 @@ PreservedAnalyses SiMBAPass::run(Function &F, FunctionAnalysisManager &FAM) {
   // Reset the MBAFound flag
   this->OG->MBAFound = false;
 
-  LSiMBA::LLVMParser Parser(&F, true, true, false, false, PrintMBADebug, true);
+  auto &Memo = this->OG->Memo;
+
+  // Attach the database on the first run
+  if (!OG->Database.empty() && !Memo.hasDatabase()) {
+    if (Memo.openDatabase(OG->Database) && OG->PrintStats) {
+      *OG->Log << "[SiMBA++] Loaded '" << Memo.Loaded
+               << "' simplifications from " << OG->Database << "\n";
+    }
+  }
 
   // Measure the time
   auto start = high_resolution_clock::now();
 
-  // Run the simplification
-  int MBACount = Parser.simplify();
+  // Replace the MBAs that were already solved
+  std::vector<MBAMemo::Candidate> Unknown;
+  int MemoCount = Memo.apply(F, Unknown);
+
+  // SiMBA already searched this exact function without finding anything
+  uint64_t Hash = Squanchy::getContentHash(F);
+  int MBACount = 0;
+  if (Memo.isKnownClean(Hash)) {
+    Memo.SkippedRuns++;
+  } else {
+    SolverTimeout Timeout(OG->WD ? OG->WD->getRemainingMs() : 0);
+
+    LSiMBA::LLVMParser Parser(&F, true, true, false, false, OG->PrintDebug,
+                              true);
+
+    // Run the simplification
+    MBACount = Parser.simplify();
+
+    // A query that ran out of time proves nothing about F
+    if (MBACount) {
+      Memo.learn(Unknown);
+    } else if (!Timeout.isActive()) {
+      Memo.markClean(Hash);
+    }
+  }
+
+  auto stop = high_resolution_clock::now();
+  auto duration = duration_cast<milliseconds>(stop - start);
 
-  if (SiMBAStats && MBACount) {
-    auto stop = high_resolution_clock::now();
-    auto duration = duration_cast<milliseconds>(stop - start);
+  this->OG->LastMBACount = MBACount;
+  this->OG->LastMemoCount = MemoCount;
+  this->OG->LastDurationMs = duration.count();
 
-    outs() << "[SiMBA++] MBAs found and replaced: '" << MBACount
-           << "' time: " << (int)duration.count() << "ms\n";
+  if (OG->PrintStats && (MBACount || MemoCount)) {
+    *OG->Log << "[SiMBA++] MBAs found and replaced: '" << MBACount
+             << "' time: " << (int)duration.count() << "ms\n";
+    *OG->Log << "[SiMBA++] Memo replaced: '" << MemoCount
+             << "' hits: " << Memo.Hits << " misses: " << Memo.Misses
+             << " learned: " << Memo.Learned
+             << " skipped runs: " << Memo.SkippedRuns << "\n";
   }
 
+  MBACount += MemoCount;
+
   if (MBACount > 0) {
     this->OG->HasOptimized = false;
     this->OG->MBAFound = true;
@@ -54,5 +144,10 @@ PreservedAnalyses SiMBAPass::run(Function &F, FunctionAnalysisManager &FAM) {
   // Increase the call counter
   this->OG->SimbaCallCounter++;
 
+  // Cached analyses of F are stale once an MBA got replaced
+  if (MBACount > 0) {
+    return PreservedAnalyses::none();
+  }
+
   return PreservedAnalyses::all();
 }
@@ -1,10 +1,40 @@
+#pragma once
+
+#include <string>
+
 #include <llvm/IR/Function.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "MBAMemo.h"
+
+namespace squanchy {
+class Watchdog;
+}
 
 typedef struct {
   bool MBAFound = false;
   bool HasOptimized = false;
   int SimbaCallCounter = 0;
+
+  // Results of the last run, reported in the pass profile
+  int LastMBACount = 0;
+  int LastMemoCount = 0;
+  int64_t LastDurationMs = 0;
+
+  // Simplifications shared by all SiMBA runs of the guide
+  MBAMemo Memo;
+
+  // Where the statistics are printed
+  llvm::raw_ostream *Log = &llvm::outs();
+
+  // SiMBA debug output, the statistics and the persistent database
+  bool PrintDebug = false;
+  bool PrintStats = true;
+  std::string Database = "";
+
+  // Limits the solver queries of a run to the time the function has left
+  squanchy::Watchdog *WD = nullptr;
 } OptimizationGuide;
 
 class SiMBAPass : public llvm::PassInfoMixin<SiMBAPass> {
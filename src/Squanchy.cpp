@@ -3,18 +3,18 @@
 
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/InitLLVM.h>
-#include <llvm/Support/TargetSelect.h>
 
 #include "Deobfuscator.h"
+#include "LLVMExtract.h"
+#include "Server.h"
+#include "SquanchyOptions.h"
 
 using namespace llvm;
 using namespace std;
 
-cl::OptionCategory SquanchyCat("Squanchy Options");
-
 static cl::opt<string> InputFilename(cl::Positional,
                                      cl::desc("Input llvm ir file"),
-                                     cl::Required, cl::cat(SquanchyCat));
+                                     cl::cat(SquanchyCat));
 
 static cl::opt<string> OutputFilename("o", cl::desc("Output llvm ir filename"),
                                       cl::value_desc("filename"),
@@ -23,7 +23,12 @@ static cl::opt<string> OutputFilename("o", cl::desc("Output llvm ir filename"),
 static cl::opt<bool> Override("override", cl::desc("Override LLVM thresholds"),
                               cl::cat(SquanchyCat), cl::init(false));
 
-void ParseLLVMOptions(int argc, char **argv) {
+static cl::opt<string>
+    Serve("serve",
+          cl::desc("Serve JSON deobfuscation requests on a Unix socket"),
+          cl::value_desc("socket"), cl::cat(SquanchyCat));
+
+vector<string> ParseLLVMOptions(int argc, char **argv) {
   SmallVector<const char *, 20> newArgv;
   BumpPtrAllocator A;
   StringSaver Saver(A);
@@ -68,23 +73,33 @@ void ParseLLVMOptions(int argc, char **argv) {
 
   int newArgc = static_cast<int>(newArgv.size());
   llvm::cl::ParseCommandLineOptions(newArgc, &newArgv[0]);
+
+  // The daemon restores these after requests with their own options
+  return vector<string>(newArgv.begin(), newArgv.end());
 }
 
 int main(int argc, char **argv) {
   InitLLVM X(argc, argv);
 
   // Some JIT Things
-  InitializeAllTargets();
-  InitializeAllTargetMCs();
-  InitializeAllAsmPrinters();
-  InitializeAllAsmParsers();
+  squanchy::Deobfuscator::initializeTargets();
+
+  cl::HideUnrelatedOptions({&SquanchyCat, &ExtractCat});
+  auto Args = ParseLLVMOptions(argc, argv);
 
-  cl::HideUnrelatedOptions(SquanchyCat);
-  ParseLLVMOptions(argc, argv);
+  if (!Serve.empty()) {
+    return squanchy::serve(Serve, Args);
+  }
+
+  if (InputFilename.empty()) {
+    errs() << "[!] No input file, pass one or use -serve\n";
+    return 1;
+  }
 
   // Deobfuscate the input file
-  squanchy::Deobfuscator Deobfuscator(InputFilename, OutputFilename);
-  if (!Deobfuscator.deobfuscate()) {
+  squanchy::Deobfuscator Deobfuscator(InputFilename, OutputFilename,
+                                      squanchy::getDeobfuscatorOptions(Args));
+  if (!Deobfuscator.isLoaded() || !Deobfuscator.deobfuscate()) {
     errs() << "[!] Could not deobfuscate the input file\n";
     return 1;
   }
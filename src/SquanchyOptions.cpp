@@ -0,0 +1,344 @@
+#include "SquanchyOptions.h"
+
+#include <memory>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+using namespace std;
+
+cl::OptionCategory SquanchyCat("Squanchy Options");
+
+// Command line options of the deobfuscator
+static cl::opt<bool> KeepWASMRuntime("keep-wasm-runtime",
+                                     cl::desc("Keep WASM runtime functions"),
+                                     cl::init(false), cl::cat(SquanchyCat));
+
+static cl::list<string>
+    FunctionNames("f", cl::desc("List of function names to deobfuscate"),
+                  cl::value_desc("function names"), cl::cat(SquanchyCat));
+
+static cl::opt<bool> Verbose("v", cl::desc("Print verbose output"),
+                             cl::cat(SquanchyCat));
+
+static cl::opt<bool>
+    PrintFunctions("list-functions",
+                   cl::desc("List all functions in the module"),
+                   cl::cat(SquanchyCat));
+
+static cl::opt<string> RuntimePath(
+    "runtime-path",
+    cl::desc("Path to the squanchy runtime (Default: built into squanchy)"),
+    cl::value_desc("path"), cl::init(""), cl::cat(SquanchyCat));
+
+static cl::opt<int> OptLevel("O", cl::desc("Optimization level (Default 3)"),
+                             cl::value_desc("level"), cl::init(3),
+                             cl::cat(SquanchyCat));
+
+static cl::opt<string> ModuleName("module-name",
+                                  cl::desc("The module-name used in wasm2c"),
+                                  cl::value_desc("module-name"),
+                                  cl::init("squanchy"), cl::cat(SquanchyCat));
+
+static cl::opt<bool> ExtractRecursive("extract-recursive",
+                                      cl::desc("extract functions recursively"),
+                                      cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<bool>
+    ExtractFunction("extract-function",
+                    cl::desc("extract function from the module"),
+                    cl::init(true), cl::cat(SquanchyCat));
+
+// Disable for now as it might lead to wrong results ...
+static cl::opt<bool> ReplaceCallocs("replace-callocs",
+                                    cl::desc("Replace callocs with allocas"),
+                                    cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<bool>
+    ReplaceInstanceRefs("replace-instance-refs",
+                        cl::desc("Replace call instance references"),
+                        cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<bool>
+    InjectInitializer("inject-initializer",
+                      cl::desc("Inject initializer for wasm instance"),
+                      cl::init(true), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned>
+    Jobs("j",
+         cl::desc("Number of functions to deobfuscate in parallel (Default 1)"),
+         cl::value_desc("N"), cl::init(1), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> MaxIterations(
+    "max-iterations",
+    cl::desc("Maximum fixpoint iterations of the custom pipeline (0 = "
+             "unlimited, Default 0)"),
+    cl::value_desc("N"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> IterationTimeBudget(
+    "iteration-time-budget",
+    cl::desc("Stop the custom pipeline fixpoint after this many seconds (0 = "
+             "unlimited)"),
+    cl::value_desc("seconds"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::opt<bool> LazyLoad(
+    "lazy-load",
+    cl::desc("Only materialize the target functions and their callees of "
+             "bitcode inputs"),
+    cl::init(true), cl::cat(SquanchyCat));
+
+static cl::opt<string> CacheDir(
+    "cache-dir",
+    cl::desc("Directory of the persistent cache of deobfuscated functions"),
+    cl::value_desc("path"), cl::init(""), cl::cat(SquanchyCat));
+
+static cl::opt<string> PassProfile(
+    "pass-profile",
+    cl::desc("Write time, instruction delta and change flag of every pass "
+             "invocation as JSON"),
+    cl::value_desc("out.json"), cl::init(""), cl::cat(SquanchyCat));
+
+static cl::opt<bool> AdaptiveSchedule(
+    "adaptive-schedule",
+    cl::desc("Skip custom pipeline passes that stopped changing the function "
+             "until SiMBA or InstCombine change it again"),
+    cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<string> Pipeline(
+    "pipeline",
+    cl::desc("Custom pipeline: a preset (squanchy, squanchy-newgvn, "
+             "squanchy-fast), a file or a pass pipeline string"),
+    cl::value_desc("pipeline"), cl::init("squanchy"), cl::cat(SquanchyCat));
+
+static cl::opt<string> PipelineNoCFG(
+    "pipeline-nocfg",
+    cl::desc("Custom pipeline of the first fixpoint that keeps the CFG "
+             "(Default: derived from -pipeline)"),
+    cl::value_desc("pipeline"), cl::init(""), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> LoopStageMaxSize(
+    "loop-stage-max-size",
+    cl::desc("Skip the loop stage for functions with more instructions (0 = "
+             "unlimited, Default 50000)"),
+    cl::value_desc("N"), cl::init(50000), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> LoopStageTimeBudget(
+    "loop-stage-time-budget",
+    cl::desc("Milliseconds the loop stage may spend per fixpoint run of a "
+             "function (0 = unlimited, Default 5000)"),
+    cl::value_desc("ms"), cl::init(5000), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> LoopFullUnrollMax(
+    "loop-full-unroll-max",
+    cl::desc("Maximum trip count of fully unrolled loops (Default 64)"),
+    cl::value_desc("N"), cl::init(64), cl::cat(SquanchyCat));
+
+static cl::opt<squanchy::ThresholdProfile> Thresholds(
+    "threshold-profile",
+    cl::desc("Pick the MemDep, DSE, GVN and DFA limits per function from its "
+             "size"),
+    cl::values(clEnumValN(squanchy::ThresholdProfile::None, "none",
+                          "Keep the LLVM limits (Default)"),
+               clEnumValN(squanchy::ThresholdProfile::Fast, "fast",
+                          "LLVM default limits"),
+               clEnumValN(squanchy::ThresholdProfile::Balanced, "balanced",
+                          "Raise the limits for small and medium functions"),
+               clEnumValN(squanchy::ThresholdProfile::Exhaustive, "exhaustive",
+                          "Limits of -override for small functions, "
+                          "scaled down for larger ones")),
+    cl::init(squanchy::ThresholdProfile::None), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> InlineMaxSize(
+    "inline-max-size",
+    cl::desc("Stop inlining helpers once a function grew to this many "
+             "instructions, the remaining helper calls are kept (0 = "
+             "unlimited, Default 0)"),
+    cl::value_desc("N"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::opt<bool> ExtractFirst(
+    "extract-first",
+    cl::desc("Extract the functions, their callees and the data segments "
+             "before optimizing"),
+    cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<bool> ScopedModuleOpt(
+    "scoped-module-opt",
+    cl::desc("Only optimize the deobfuscated functions and what they "
+             "reference in the final module pass"),
+    cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> FunctionTimeout(
+    "function-timeout",
+    cl::desc("Stop deobfuscating a function after this many seconds and keep "
+             "the smallest version seen so far (0 = unlimited)"),
+    cl::value_desc("seconds"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> FunctionMemoryLimit(
+    "function-memory-limit",
+    cl::desc("Stop deobfuscating a function once the heap grows beyond this "
+             "many megabytes and keep the smallest version seen so far. The "
+             "heap is measured for the whole process, with -j it includes "
+             "the other workers (0 = unlimited)"),
+    cl::value_desc("MB"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::opt<bool> StreamOutput(
+    "stream-output",
+    cl::desc("Write every function to its own file as soon as it is "
+             "deobfuscated and drop it from memory"),
+    cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<bool> EmitBC("emit-bc",
+                            cl::desc("Write bitcode instead of textual IR"),
+                            cl::init(false), cl::cat(SquanchyCat));
+
+static cl::opt<unsigned> SplitOutput(
+    "split-output",
+    cl::desc("Split the output module into N partitions written to "
+             "<output>.<i>.ll/.bc"),
+    cl::value_desc("N"), cl::init(0), cl::cat(SquanchyCat));
+
+static cl::list<string>
+    ClangArgs("clang-arg",
+              cl::desc("Extra clang argument for .c inputs, requires "
+                       "SQUANCHY_CLANG_FRONTEND"),
+              cl::value_desc("argument"), cl::cat(SquanchyCat));
+
+static cl::opt<bool> SiMBADebug("simba-debug", cl::Optional,
+                                cl::desc("Print SiMBA debug output"),
+                                cl::value_desc("simba-debug"), cl::init(false));
+
+static cl::opt<bool> SiMBAStats("simba-stats", cl::Optional,
+                                cl::desc("Print SiMBA stats"),
+                                cl::value_desc("simba-stats"), cl::init(true));
+
+static cl::opt<std::string>
+    SiMBADatabase("simba-db", cl::Optional,
+                  cl::desc("Persistent database of MBA simplifications"),
+                  cl::value_desc("path"), cl::init(""));
+
+// Everything getDeobfuscatorOptions reads, cl::list overloads operator&
+static cl::Option *const DeobfuscatorOptionList[] = {
+    &KeepWASMRuntime,
+    std::addressof(FunctionNames),
+    &Verbose,
+    &PrintFunctions,
+    &RuntimePath,
+    &OptLevel,
+    &ModuleName,
+    &ExtractRecursive,
+    &ExtractFunction,
+    &ReplaceCallocs,
+    &ReplaceInstanceRefs,
+    &InjectInitializer,
+    &Jobs,
+    &MaxIterations,
+    &IterationTimeBudget,
+    &LazyLoad,
+    &CacheDir,
+    &PassProfile,
+    &AdaptiveSchedule,
+    &Pipeline,
+    &PipelineNoCFG,
+    &LoopStageMaxSize,
+    &LoopStageTimeBudget,
+    &LoopFullUnrollMax,
+    &Thresholds,
+    &InlineMaxSize,
+    &ExtractFirst,
+    &ScopedModuleOpt,
+    &FunctionTimeout,
+    &FunctionMemoryLimit,
+    &StreamOutput,
+    &EmitBC,
+    &SplitOutput,
+    std::addressof(ClangArgs),
+    &SiMBADebug,
+    &SiMBAStats,
+    &SiMBADatabase,
+};
+
+namespace squanchy {
+
+// The arguments that set LLVM options, values must be given with '='
+static std::vector<std::string> getLLVMArgs(ArrayRef<std::string> Args) {
+  auto &Registered = cl::getRegisteredOptions();
+
+  std::vector<std::string> LLVMArgs;
+  for (auto &Arg : Args.drop_front()) {
+    if (!StringRef(Arg).starts_with("-")) {
+      continue;
+    }
+
+    auto Name = StringRef(Arg).ltrim('-').split('=').first;
+    auto It = Registered.find(Name);
+    if (It == Registered.end() || isDeobfuscatorOption(Arg) ||
+        llvm::is_contained(It->second->Categories, &SquanchyCat)) {
+      continue;
+    }
+    LLVMArgs.push_back(Arg);
+  }
+
+  return LLVMArgs;
+}
+
+DeobfuscatorOptions getDeobfuscatorOptions(ArrayRef<std::string> Args) {
+  DeobfuscatorOptions Options;
+  Options.Functions = FunctionNames;
+  Options.PrintFunctions = PrintFunctions;
+  Options.Verbose = Verbose;
+  Options.KeepWASMRuntime = KeepWASMRuntime;
+  Options.RuntimePath = RuntimePath;
+  Options.OptLevel = OptLevel;
+  Options.ModuleName = ModuleName;
+  Options.ExtractFunction = ExtractFunction;
+  Options.ExtractRecursive = ExtractRecursive;
+  Options.ExtractFirst = ExtractFirst;
+  Options.LazyLoad = LazyLoad;
+  Options.ReplaceCallocs = ReplaceCallocs;
+  Options.ReplaceInstanceRefs = ReplaceInstanceRefs;
+  Options.InjectInitializer = InjectInitializer;
+  Options.Jobs = Jobs;
+  Options.MaxIterations = MaxIterations;
+  Options.IterationTimeBudget = IterationTimeBudget;
+  Options.Pipeline = Pipeline;
+  Options.PipelineNoCFG = PipelineNoCFG;
+  Options.AdaptiveSchedule = AdaptiveSchedule;
+  Options.LoopStageMaxSize = LoopStageMaxSize;
+  Options.LoopStageTimeBudget = LoopStageTimeBudget;
+  Options.LoopFullUnrollMax = LoopFullUnrollMax;
+  Options.Thresholds = Thresholds;
+  Options.InlineMaxSize = InlineMaxSize;
+  Options.ScopedModuleOpt = ScopedModuleOpt;
+  Options.FunctionTimeout = FunctionTimeout;
+  Options.FunctionMemoryLimit = FunctionMemoryLimit;
+  Options.CacheDir = CacheDir;
+  Options.PassProfile = PassProfile;
+  Options.StreamOutput = StreamOutput;
+  Options.EmitBC = EmitBC;
+  Options.SplitOutput = SplitOutput;
+  Options.ClangArgs = ClangArgs;
+  Options.SiMBADebug = SiMBADebug;
+  Options.SiMBAStats = SiMBAStats;
+  Options.SiMBADatabase = SiMBADatabase;
+  Options.LLVMArgs = getLLVMArgs(Args);
+  return Options;
+}
+
+bool isDeobfuscatorOption(StringRef Arg) {
+  // Values given as separate arguments
+  if (!Arg.starts_with("-")) {
+    return true;
+  }
+
+  auto Name = Arg.ltrim('-').split('=').first;
+  for (auto O : DeobfuscatorOptionList) {
+    if (O->ArgStr == Name) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+} // namespace squanchy
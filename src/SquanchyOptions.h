@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "DeobfuscatorOptions.h"
+
+// Options of the squanchy command line, the rest is hidden
+extern llvm::cl::OptionCategory SquanchyCat;
+
+namespace squanchy {
+
+/*
+ * The deobfuscator options given on the command line, Args is the command
+ * line that was parsed
+ */
+DeobfuscatorOptions getDeobfuscatorOptions(llvm::ArrayRef<std::string> Args);
+
+/*
+ * True if Arg only sets a field of DeobfuscatorOptions, anything else
+ * changes process wide LLVM or squanchy state
+ */
+bool isDeobfuscatorOption(llvm::StringRef Arg);
+
+} // namespace squanchy
@@ -0,0 +1,131 @@
+#include "ThresholdProfile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+namespace {
+
+struct Threshold {
+  const char *Name;
+  int64_t Default;
+};
+
+// The limits raised by -override with their LLVM defaults
+const Threshold Thresholds[] = {
+    {"memdep-block-scan-limit", 100},
+    {"memdep-block-number-limit", 200},
+    {"available-load-scan-limit", 6},
+    {"memssa-check-limit", 100},
+    {"earlycse-mssa-optimization-cap", 500},
+    {"dse-memoryssa-walklimit", 90},
+    {"dse-memoryssa-scanlimit", 150},
+    {"dse-memoryssa-defs-per-block-limit", 5000},
+    {"dse-memoryssa-partial-store-limit", 5},
+    {"dse-memoryssa-path-check-limit", 50},
+    {"gvn-max-block-speculations", 600},
+    {"gvn-max-num-deps", 100},
+    {"gvn-hoist-max-chain-length", 10},
+    {"gvn-hoist-max-depth", 100},
+    {"gvn-hoist-max-bbs", 4},
+    {"dfa-cost-threshold", 50},
+    {"dfa-max-path-length", 20},
+    {"dfa-max-num-paths", 200},
+};
+
+enum SizeClass { Small, Medium, Large, Huge };
+
+const char *SizeClassNames[] = {"small", "medium", "large", "huge"};
+
+// Multiplier of the LLVM default per profile and size class, 0 selects the
+// limit of -override
+const int64_t Multipliers[][4] = {
+    /* Fast */ {1, 1, 1, 1},
+    /* Balanced */ {100, 20, 4, 1},
+    /* Exhaustive */ {0, 1000, 100, 20},
+};
+
+const int64_t OverrideLimit = 1000000;
+
+SizeClass getSizeClass(unsigned Instructions, unsigned Blocks) {
+  if (Instructions > 250000 || Blocks > 25000) {
+    return Huge;
+  }
+  if (Instructions > 50000 || Blocks > 5000) {
+    return Large;
+  }
+  if (Instructions > 5000 || Blocks > 500) {
+    return Medium;
+  }
+  return Small;
+}
+
+} // namespace
+
+const char *getThresholdProfileName(ThresholdProfile Profile) {
+  switch (Profile) {
+  case ThresholdProfile::None:
+    return "none";
+  case ThresholdProfile::Fast:
+    return "fast";
+  case ThresholdProfile::Balanced:
+    return "balanced";
+  case ThresholdProfile::Exhaustive:
+    return "exhaustive";
+  }
+  return "";
+}
+
+const char *applyThresholdProfile(ThresholdProfile Profile,
+                                  unsigned Instructions, unsigned Blocks) {
+  if (Profile == ThresholdProfile::None) {
+    return "";
+  }
+
+  SizeClass Class = getSizeClass(Instructions, Blocks);
+  int64_t Multiplier = Multipliers[(int)Profile - 1][Class];
+
+  auto &Options = cl::getRegisteredOptions();
+  for (auto &T : Thresholds) {
+    auto It = Options.find(T.Name);
+    if (It == Options.end()) {
+      continue;
+    }
+
+    // Set by the user, keep it
+    auto Opt = It->second;
+    if (Opt->getNumOccurrences()) {
+      continue;
+    }
+
+    int64_t Limit = Multiplier ? std::min(T.Default * Multiplier, OverrideLimit)
+                               : OverrideLimit;
+
+    // MultiArg keeps the occurrence count, the option can be set again for
+    // the next function
+    Opt->addOccurrence(0, T.Name, std::to_string(Limit), true);
+  }
+
+  return SizeClassNames[Class];
+}
+
+void resetThresholdProfile() {
+  auto &Options = cl::getRegisteredOptions();
+  for (auto &T : Thresholds) {
+    auto It = Options.find(T.Name);
+    if (It == Options.end() || It->second->getNumOccurrences()) {
+      continue;
+    }
+
+    It->second->addOccurrence(0, T.Name, std::to_string(T.Default), true);
+  }
+}
+
+} // namespace squanchy
@@ -0,0 +1,25 @@
+#pragma once
+
+namespace squanchy {
+
+enum class ThresholdProfile { None, Fast, Balanced, Exhaustive };
+
+const char *getThresholdProfileName(ThresholdProfile Profile);
+
+/*
+ * Set the MemDep, MemorySSA, DSE, GVN and DFA jump threading limits for a
+ * function with the given number of instructions and blocks. Limits given
+ * on the command line (or by -override) are left alone. The options are
+ * process wide, so this must not run while other threads optimize.
+ *
+ * Returns the name of the size class that was picked.
+ */
+const char *applyThresholdProfile(ThresholdProfile Profile,
+                                  unsigned Instructions, unsigned Blocks);
+
+/*
+ * Set the limits applyThresholdProfile changed back to the LLVM defaults
+ */
+void resetThresholdProfile();
+
+} // namespace squanchy
@@ -0,0 +1,2321 @@
+#include "WasmLifter.h"
+
+#include <cmath>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+namespace {
+
+// Value types
+enum : uint8_t {
+  WASM_I32 = 0x7F,
+  WASM_I64 = 0x7E,
+  WASM_F32 = 0x7D,
+  WASM_F64 = 0x7C,
+  WASM_V128 = 0x7B,
+  WASM_FUNCREF = 0x70,
+  WASM_EXTERNREF = 0x6F,
+};
+
+// External kinds of imports and exports
+enum : uint8_t {
+  WASM_EXTERNAL_FUNCTION = 0,
+  WASM_EXTERNAL_TABLE = 1,
+  WASM_EXTERNAL_MEMORY = 2,
+  WASM_EXTERNAL_GLOBAL = 3,
+};
+
+// The page size of the wasm memory
+constexpr uint64_t WASM_PAGE_SIZE = 65536;
+
+/*
+ * Bounds checked reader over a section or function body. Reading past the
+ * end latches the failed state and returns zeros.
+ */
+class WasmReader {
+public:
+  WasmReader(StringRef Data) : Data(Data) {}
+
+  bool failed() const { return Failed; }
+  bool empty() const { return Failed || Pos >= Data.size(); }
+  size_t getOffset() const { return Pos; }
+
+  uint8_t peekByte() {
+    if (Pos >= Data.size()) {
+      Failed = true;
+      return 0;
+    }
+    return Data[Pos];
+  }
+
+  uint8_t readByte() {
+    uint8_t Byte = peekByte();
+    if (!Failed) {
+      Pos++;
+    }
+    return Byte;
+  }
+
+  uint64_t readULEB() {
+    unsigned Length = 0;
+    const char *Error = nullptr;
+    auto Begin = Data.bytes_begin() + Pos;
+    uint64_t Value = decodeULEB128(Begin, &Length, Data.bytes_end(), &Error);
+    if (Error) {
+      Failed = true;
+      return 0;
+    }
+    Pos += Length;
+    return Value;
+  }
+
+  int64_t readSLEB() {
+    unsigned Length = 0;
+    const char *Error = nullptr;
+    auto Begin = Data.bytes_begin() + Pos;
+    int64_t Value = decodeSLEB128(Begin, &Length, Data.bytes_end(), &Error);
+    if (Error) {
+      Failed = true;
+      return 0;
+    }
+    Pos += Length;
+    return Value;
+  }
+
+  uint32_t readU32() {
+    uint64_t Value = readULEB();
+    if (Value > UINT32_MAX) {
+      Failed = true;
+      return 0;
+    }
+    return Value;
+  }
+
+  uint64_t readFixed(unsigned Bytes) {
+    uint64_t Value = 0;
+    for (unsigned i = 0; i < Bytes; i++) {
+      Value |= (uint64_t)readByte() << (i * 8);
+    }
+    return Value;
+  }
+
+  StringRef readBytes(uint64_t Size) {
+    if (Size > Data.size() - Pos) {
+      Failed = true;
+      return StringRef();
+    }
+    auto Bytes = Data.substr(Pos, Size);
+    Pos += Size;
+    return Bytes;
+  }
+
+  StringRef readName() { return readBytes(readU32()); }
+
+private:
+  StringRef Data;
+  size_t Pos = 0;
+  bool Failed = false;
+};
+
+struct WasmFuncType {
+  SmallVector<uint8_t, 4> Params;
+  SmallVector<uint8_t, 1> Results;
+};
+
+// Constant expression of globals, data and element segment offsets
+struct WasmConstExpr {
+  uint8_t Opcode = 0;
+  uint64_t Value = 0;
+};
+
+struct WasmLimits {
+  uint64_t Min = 0;
+  uint64_t Max = 0;
+  bool HasMax = false;
+};
+
+struct WasmImport {
+  std::string Module;
+  std::string Field;
+};
+
+struct WasmFunc {
+  uint32_t Type = 0;
+  bool Imported = false;
+  WasmImport Import;
+  StringRef Body;
+  llvm::Function *F = nullptr;
+};
+
+struct WasmGlobal {
+  uint8_t Type = 0;
+  bool Imported = false;
+  WasmImport Import;
+  WasmConstExpr Init;
+  unsigned Field = 0;
+};
+
+// Memories and tables
+struct WasmStorage {
+  WasmLimits Limits;
+  bool Imported = false;
+  WasmImport Import;
+  unsigned Field = 0;
+};
+
+struct WasmDataSegment {
+  bool Active = false;
+  WasmConstExpr Offset;
+  StringRef Bytes;
+};
+
+struct WasmElemSegment {
+  uint32_t Table = 0;
+  WasmConstExpr Offset;
+  std::vector<uint32_t> Functions;
+};
+
+struct WasmExport {
+  std::string Name;
+  uint8_t Kind = 0;
+  uint32_t Index = 0;
+};
+
+/*
+ * Mangle a wasm name the way wasm2c does: characters outside of [A-Za-z0-9_]
+ * and underscores following another underscore are escaped as 0xXX
+ */
+std::string mangleName(StringRef Prefix, StringRef Name) {
+  std::string Result = Prefix.str();
+  for (unsigned char C : Name) {
+    if (isAlnum(C) || (C == '_' && (Result.empty() || Result.back() != '_'))) {
+      Result += C;
+    } else {
+      Result += formatv("0x{0:X-2}", (unsigned)C).str();
+    }
+  }
+  return Result;
+}
+
+class WasmLifter {
+public:
+  WasmLifter(MemoryBufferRef Buffer, StringRef ModuleName,
+             LLVMContext &Context)
+      : Context(Context), Prefix(mangleName("w2c_", ModuleName) + "_"),
+        InstantiatePrefix(mangleName("wasm2c_", ModuleName) + "_"),
+        M(std::make_unique<Module>(Buffer.getBufferIdentifier(), Context)),
+        Buffer(Buffer) {}
+
+  Expected<std::unique_ptr<Module>> lift();
+
+  // Shared with the function lifter
+  LLVMContext &Context;
+  std::string Prefix;
+  std::string InstantiatePrefix;
+  std::unique_ptr<Module> M;
+
+  std::vector<WasmFuncType> Types;
+  std::vector<WasmFunc> Funcs;
+  std::vector<WasmGlobal> Globals;
+  std::vector<WasmStorage> Memories;
+  std::vector<WasmStorage> Tables;
+  std::vector<WasmDataSegment> DataSegments;
+  std::vector<WasmElemSegment> ElemSegments;
+  std::vector<WasmExport> Exports;
+  std::map<uint32_t, std::string> FunctionNames;
+  int64_t StartFunction = -1;
+
+  // Import modules in the order of the instantiate parameters
+  std::vector<std::string> ImportModules = {"env"};
+  std::map<std::string, unsigned> ImportModuleFields;
+
+  StructType *InstanceTy = nullptr;
+  StructType *MemoryTy = nullptr;
+  StructType *TableTy = nullptr;
+  StructType *FuncRefTy = nullptr;
+  PointerType *PtrTy = nullptr;
+
+  bool fail(const Twine &Message) {
+    if (ErrorMessage.empty()) {
+      ErrorMessage = Message.str();
+    }
+    return false;
+  }
+
+  Type *getValueType(uint8_t ValueType);
+  FunctionType *getFunctionType(const WasmFuncType &FT, bool WithInstance);
+  Type *getReturnType(const WasmFuncType &FT);
+
+  // Pointers into the instance, imports are stored as pointers
+  Value *getImportInstance(IRBuilder<> &B, Value *Instance,
+                           const WasmImport &Import);
+  Value *getGlobalPtr(IRBuilder<> &B, Value *Instance, uint32_t Index);
+  Value *getMemoryPtr(IRBuilder<> &B, Value *Instance, uint32_t Index);
+  Value *getTablePtr(IRBuilder<> &B, Value *Instance, uint32_t Index);
+  Value *emitConstExpr(IRBuilder<> &B, Value *Instance,
+                       const WasmConstExpr &Expr, Type *Ty);
+
+private:
+  MemoryBufferRef Buffer;
+  std::string ErrorMessage;
+
+  bool parseSection(uint8_t Id, WasmReader &R);
+  bool parseTypes(WasmReader &R);
+  bool parseImports(WasmReader &R);
+  bool parseFunctions(WasmReader &R);
+  bool parseTables(WasmReader &R);
+  bool parseMemories(WasmReader &R);
+  bool parseGlobals(WasmReader &R);
+  bool parseExports(WasmReader &R);
+  bool parseElements(WasmReader &R);
+  bool parseCode(WasmReader &R);
+  bool parseData(WasmReader &R);
+  bool parseNames(WasmReader &R);
+  bool parseLimits(WasmReader &R, WasmLimits &Limits);
+  bool parseConstExpr(WasmReader &R, WasmConstExpr &Expr);
+
+  void createTypes();
+  void declareFunctions();
+  void createExports();
+  void createInstantiate();
+
+  Function *createInitFunction(StringRef Name);
+  Function *getImportAccessor(const WasmImport &Import);
+};
+
+/*
+ * Lifts a single function body. The operand stack is kept at compile time,
+ * locals become allocas and block results flow through phis.
+ */
+class FunctionLifter {
+public:
+  FunctionLifter(WasmLifter &L, uint32_t Index)
+      : L(L), Index(Index), Func(L.Funcs[Index]), F(Func.F), B(L.Context) {}
+
+  bool lift();
+
+private:
+  enum class FrameKind { Function, Block, Loop, If };
+
+  struct Frame {
+    FrameKind Kind;
+    SmallVector<Type *, 1> Params;
+    SmallVector<Type *, 1> Results;
+
+    // Branch target, the loop header for loops and the end block otherwise
+    BasicBlock *Target = nullptr;
+    BasicBlock *End = nullptr;
+    SmallVector<PHINode *, 1> LoopPHIs;
+    SmallVector<PHINode *, 1> EndPHIs;
+
+    // Pending else block of an if and the params it starts with
+    BasicBlock *Else = nullptr;
+    SmallVector<Value *, 1> IfParams;
+
+    size_t Height = 0;
+    bool Unreachable = false;
+  };
+
+  WasmLifter &L;
+  uint32_t Index;
+  WasmFunc &Func;
+  Function *F;
+  IRBuilder<> B;
+  Value *Instance = nullptr;
+
+  SmallVector<AllocaInst *, 16> Locals;
+  SmallVector<Value *, 32> Stack;
+  SmallVector<Frame, 8> Frames;
+  size_t Offset = 0;
+
+  // Shared by all checks that trap
+  BasicBlock *TrapBlock = nullptr;
+
+  bool fail(const Twine &Message) {
+    auto Function = formatv("function {0} ({1}): ", Index, F->getName()).str();
+    auto Location = formatv(" at body offset {0:x}", Offset).str();
+    return L.fail(Function + Message + Location);
+  }
+
+  bool lift(WasmReader &R, uint8_t Opcode);
+  bool liftNumeric(uint8_t Opcode);
+  bool liftPrefixed(WasmReader &R);
+
+  Value *pop(Type *Ty);
+  bool popValues(ArrayRef<Type *> Types, SmallVectorImpl<Value *> &Values);
+  void push(Value *V) { Stack.push_back(V); }
+  bool pushResults(Value *Result, const WasmFuncType &FT);
+
+  bool readBlockType(WasmReader &R, SmallVectorImpl<Type *> &Params,
+                     SmallVectorImpl<Type *> &Results);
+  Frame &createFrame(FrameKind Kind, ArrayRef<Type *> Params,
+                     ArrayRef<Type *> Results, const Twine &Name);
+
+  ArrayRef<Type *> getLabelTypes(const Frame &Fr) {
+    return Fr.Kind == FrameKind::Loop ? ArrayRef<Type *>(Fr.Params)
+                                      : ArrayRef<Type *>(Fr.Results);
+  }
+  ArrayRef<PHINode *> getLabelPHIs(const Frame &Fr) {
+    return Fr.Kind == FrameKind::Loop ? ArrayRef<PHINode *>(Fr.LoopPHIs)
+                                      : ArrayRef<PHINode *>(Fr.EndPHIs);
+  }
+
+  void addIncoming(ArrayRef<PHINode *> PHIs, ArrayRef<Value *> Values,
+                   BasicBlock *From);
+  bool branch(uint32_t Depth);
+  bool exitFrame(Frame &Fr);
+  bool endFrame();
+  void markUnreachable();
+  void terminateUnreachable();
+  void trapIf(Value *Cond);
+
+  Value *getAddress(WasmReader &R, Value *Address);
+  Value *getMemoryAddress(Value *Address, uint64_t Offset);
+  Value *callIntrinsic(Intrinsic::ID ID, ArrayRef<Type *> Types,
+                       ArrayRef<Value *> Args);
+};
+
+Type *WasmLifter::getValueType(uint8_t ValueType) {
+  switch (ValueType) {
+  case WASM_I32:
+    return Type::getInt32Ty(Context);
+  case WASM_I64:
+    return Type::getInt64Ty(Context);
+  case WASM_F32:
+    return Type::getFloatTy(Context);
+  case WASM_F64:
+    return Type::getDoubleTy(Context);
+  default:
+    fail(formatv("unsupported value type {0:x}", ValueType));
+    return nullptr;
+  }
+}
+
+Type *WasmLifter::getReturnType(const WasmFuncType &FT) {
+  if (FT.Results.empty()) {
+    return Type::getVoidTy(Context);
+  }
+
+  if (FT.Results.size() == 1) {
+    return getValueType(FT.Results[0]);
+  }
+
+  // wasm2c returns multiple values in a struct
+  SmallVector<Type *, 4> Elements;
+  for (auto Result : FT.Results) {
+    Elements.push_back(getValueType(Result));
+  }
+  return StructType::get(Context, Elements);
+}
+
+FunctionType *WasmLifter::getFunctionType(const WasmFuncType &FT,
+                                          bool WithInstance) {
+  SmallVector<Type *, 8> Params;
+  if (WithInstance) {
+    Params.push_back(PtrTy);
+  }
+  for (auto Param : FT.Params) {
+    Params.push_back(getValueType(Param));
+  }
+
+  return FunctionType::get(getReturnType(FT), Params, false);
+}
+
+bool WasmLifter::parseLimits(WasmReader &R, WasmLimits &Limits) {
+  uint8_t Flags = R.readByte();
+  if (Flags & 0x04) {
+    return fail("64 bit memories are not supported");
+  }
+
+  // Shared memories are treated as regular ones
+  Limits.Min = R.readU32();
+  Limits.HasMax = Flags & 0x01;
+  if (Limits.HasMax) {
+    Limits.Max = R.readU32();
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseConstExpr(WasmReader &R, WasmConstExpr &Expr) {
+  Expr.Opcode = R.readByte();
+  switch (Expr.Opcode) {
+  case 0x41: // i32.const
+  case 0x42: // i64.const
+    Expr.Value = R.readSLEB();
+    break;
+  case 0x43: // f32.const
+    Expr.Value = R.readFixed(4);
+    break;
+  case 0x44: // f64.const
+    Expr.Value = R.readFixed(8);
+    break;
+  case 0x23: // global.get
+    Expr.Value = R.readU32();
+    if (Expr.Value >= Globals.size()) {
+      return fail("constant expression references an unknown global");
+    }
+    break;
+  default:
+    return fail(formatv("unsupported constant expression opcode {0:x}",
+                        Expr.Opcode));
+  }
+
+  if (R.readByte() != 0x0B) {
+    return fail("extended constant expressions are not supported");
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseTypes(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    if (R.readByte() != 0x60) {
+      return fail("unsupported type form");
+    }
+
+    WasmFuncType FT;
+    uint32_t Params = R.readU32();
+    for (uint32_t j = 0; j < Params && !R.failed(); j++) {
+      FT.Params.push_back(R.readByte());
+      if (!getValueType(FT.Params.back())) {
+        return false;
+      }
+    }
+    uint32_t Results = R.readU32();
+    for (uint32_t j = 0; j < Results && !R.failed(); j++) {
+      FT.Results.push_back(R.readByte());
+      if (!getValueType(FT.Results.back())) {
+        return false;
+      }
+    }
+    Types.push_back(FT);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseImports(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmImport Import;
+    Import.Module = R.readName().str();
+    Import.Field = R.readName().str();
+
+    if (llvm::find(ImportModules, Import.Module) == ImportModules.end()) {
+      ImportModules.push_back(Import.Module);
+    }
+
+    uint8_t Kind = R.readByte();
+    switch (Kind) {
+    case WASM_EXTERNAL_FUNCTION: {
+      WasmFunc Func;
+      Func.Type = R.readU32();
+      if (Func.Type >= Types.size()) {
+        return fail("import references an unknown type");
+      }
+      Func.Imported = true;
+      Func.Import = Import;
+      Funcs.push_back(Func);
+      break;
+    }
+    case WASM_EXTERNAL_TABLE: {
+      WasmStorage Table;
+      if (R.readByte() != WASM_FUNCREF) {
+        return fail("only funcref tables are supported");
+      }
+      if (!parseLimits(R, Table.Limits)) {
+        return false;
+      }
+      Table.Imported = true;
+      Table.Import = Import;
+      Tables.push_back(Table);
+      break;
+    }
+    case WASM_EXTERNAL_MEMORY: {
+      WasmStorage Memory;
+      if (!parseLimits(R, Memory.Limits)) {
+        return false;
+      }
+      Memory.Imported = true;
+      Memory.Import = Import;
+      Memories.push_back(Memory);
+      break;
+    }
+    case WASM_EXTERNAL_GLOBAL: {
+      WasmGlobal Global;
+      Global.Type = R.readByte();
+      R.readByte(); // mutability
+      if (!getValueType(Global.Type)) {
+        return false;
+      }
+      Global.Imported = true;
+      Global.Import = Import;
+      Globals.push_back(Global);
+      break;
+    }
+    default:
+      return fail(formatv("unsupported import kind {0}", Kind));
+    }
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseFunctions(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmFunc Func;
+    Func.Type = R.readU32();
+    if (Func.Type >= Types.size()) {
+      return fail("function references an unknown type");
+    }
+    Funcs.push_back(Func);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseTables(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmStorage Table;
+    if (R.readByte() != WASM_FUNCREF) {
+      return fail("only funcref tables are supported");
+    }
+    if (!parseLimits(R, Table.Limits)) {
+      return false;
+    }
+    Tables.push_back(Table);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseMemories(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmStorage Memory;
+    if (!parseLimits(R, Memory.Limits)) {
+      return false;
+    }
+    Memories.push_back(Memory);
+  }
+
+  if (Memories.size() > 1) {
+    return fail("multiple memories are not supported");
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseGlobals(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmGlobal Global;
+    Global.Type = R.readByte();
+    R.readByte(); // mutability
+    if (!getValueType(Global.Type) || !parseConstExpr(R, Global.Init)) {
+      return false;
+    }
+    Globals.push_back(Global);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseExports(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    WasmExport Export;
+    Export.Name = R.readName().str();
+    Export.Kind = R.readByte();
+    Export.Index = R.readU32();
+
+    if (Export.Kind == WASM_EXTERNAL_FUNCTION &&
+        Export.Index >= Funcs.size()) {
+      return fail("export references an unknown function");
+    }
+    Exports.push_back(Export);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseElements(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    uint32_t Flags = R.readU32();
+    if (Flags > 3) {
+      return fail("element segments with expressions are not supported");
+    }
+
+    WasmElemSegment Segment;
+    bool Active = !(Flags & 0x01);
+    if (Flags == 2) {
+      Segment.Table = R.readU32();
+    }
+    if (Active && !parseConstExpr(R, Segment.Offset)) {
+      return false;
+    }
+    if (Flags != 0 && R.readByte() != 0x00) {
+      return fail("unsupported element kind");
+    }
+
+    uint32_t Functions = R.readU32();
+    for (uint32_t j = 0; j < Functions && !R.failed(); j++) {
+      uint32_t Func = R.readU32();
+      if (Func >= Funcs.size()) {
+        return fail("element segment references an unknown function");
+      }
+      Segment.Functions.push_back(Func);
+    }
+
+    // Passive and declarative segments only matter for table.init
+    if (!Active) {
+      continue;
+    }
+
+    if (Segment.Table >= Tables.size()) {
+      return fail("element segment references an unknown table");
+    }
+    ElemSegments.push_back(std::move(Segment));
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseCode(WasmReader &R) {
+  uint32_t Count = R.readU32();
+
+  // The defined functions follow the imported ones
+  unsigned FirstDefined = 0;
+  while (FirstDefined < Funcs.size() && Funcs[FirstDefined].Imported) {
+    FirstDefined++;
+  }
+  if (Count != Funcs.size() - FirstDefined) {
+    return fail("the code and function sections do not match");
+  }
+
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    Funcs[FirstDefined + i].Body = R.readName();
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseData(WasmReader &R) {
+  uint32_t Count = R.readU32();
+  for (uint32_t i = 0; i < Count && !R.failed(); i++) {
+    uint32_t Flags = R.readU32();
+    if (Flags > 2) {
+      return fail("unsupported data segment");
+    }
+
+    WasmDataSegment Segment;
+    Segment.Active = Flags != 1;
+    if (Flags == 2 && R.readU32() != 0) {
+      return fail("multiple memories are not supported");
+    }
+    if (Segment.Active && !parseConstExpr(R, Segment.Offset)) {
+      return false;
+    }
+    Segment.Bytes = R.readName();
+
+    if (Segment.Active && Memories.empty()) {
+      return fail("data segment without a memory");
+    }
+    DataSegments.push_back(Segment);
+  }
+
+  return !R.failed();
+}
+
+bool WasmLifter::parseNames(WasmReader &R) {
+  while (!R.empty()) {
+    uint8_t Id = R.readByte();
+    WasmReader Subsection(R.readName());
+
+    // Only the function names are used
+    if (Id != 1) {
+      continue;
+    }
+
+    uint32_t Count = Subsection.readU32();
+    for (uint32_t i = 0; i < Count && !Subsection.failed(); i++) {
+      uint32_t Func = Subsection.readU32();
+      FunctionNames[Func] = Subsection.readName().str();
+    }
+  }
+
+  // A broken name section does not invalidate the module
+  return true;
+}
+
+bool WasmLifter::parseSection(uint8_t Id, WasmReader &R) {
+  switch (Id) {
+  case 0: {
+    if (R.readName() == "name") {
+      return parseNames(R);
+    }
+    return true;
+  }
+  case 1:
+    return parseTypes(R);
+  case 2:
+    return parseImports(R);
+  case 3:
+    return parseFunctions(R);
+  case 4:
+    return parseTables(R);
+  case 5:
+    return parseMemories(R);
+  case 6:
+    return parseGlobals(R);
+  case 7:
+    return parseExports(R);
+  case 8:
+    StartFunction = R.readU32();
+    if (StartFunction >= (int64_t)Funcs.size()) {
+      return fail("the start function does not exist");
+    }
+    return !R.failed();
+  case 9:
+    return parseElements(R);
+  case 10:
+    return parseCode(R);
+  case 11:
+    return parseData(R);
+  case 12: // data count
+    return true;
+  default:
+    return fail(formatv("unsupported section {0}", Id));
+  }
+}
+
+void WasmLifter::createTypes() {
+  PtrTy = PointerType::get(Context, 0);
+
+  auto getStruct = [&](StringRef Name, ArrayRef<Type *> Elements) {
+    if (auto ST = StructType::getTypeByName(Context, Name)) {
+      return ST;
+    }
+    return StructType::create(Context, Elements, Name);
+  };
+
+  auto I8Ty = Type::getInt8Ty(Context);
+  auto I32Ty = Type::getInt32Ty(Context);
+  auto I64Ty = Type::getInt64Ty(Context);
+
+  // Layouts of wasm-rt.h
+  MemoryTy = getStruct("struct.wasm_rt_memory_t",
+                       {PtrTy, I64Ty, I64Ty, I64Ty, I8Ty});
+  TableTy = getStruct("struct.wasm_rt_funcref_table_t", {PtrTy, I32Ty, I32Ty});
+  FuncRefTy =
+      getStruct("struct.wasm_rt_funcref_t", {PtrTy, PtrTy, PtrTy, PtrTy});
+
+  // The instance holds the import instances, pointers to the imported
+  // entities and the defined globals, memories and tables
+  SmallVector<Type *, 32> Fields;
+  for (auto &Module : ImportModules) {
+    ImportModuleFields[Module] = Fields.size();
+    Fields.push_back(PtrTy);
+  }
+
+  for (auto &Global : Globals) {
+    Global.Field = Fields.size();
+    Fields.push_back(Global.Imported ? PtrTy : getValueType(Global.Type));
+  }
+  for (auto &Memory : Memories) {
+    Memory.Field = Fields.size();
+    Fields.push_back(Memory.Imported ? PtrTy : (Type *)MemoryTy);
+  }
+  for (auto &Table : Tables) {
+    Table.Field = Fields.size();
+    Fields.push_back(Table.Imported ? PtrTy : (Type *)TableTy);
+  }
+
+  auto InstanceName = "struct." + StringRef(Prefix).drop_back().str();
+  InstanceTy = StructType::create(Context, Fields, InstanceName);
+}
+
+void WasmLifter::declareFunctions() {
+  // Export wrappers take the plain names
+  std::set<std::string> ExportNames;
+  for (auto &Export : Exports) {
+    if (Export.Kind == WASM_EXTERNAL_FUNCTION) {
+      ExportNames.insert(mangleName(Prefix, Export.Name));
+    }
+  }
+
+  for (uint32_t i = 0; i < Funcs.size(); i++) {
+    auto &Func = Funcs[i];
+    auto FT = getFunctionType(Types[Func.Type], true);
+
+    if (Func.Imported) {
+      auto Name = mangleName(mangleName("w2c_", Func.Import.Module) + "_",
+                             Func.Import.Field);
+      Func.F = cast<Function>(M->getOrInsertFunction(Name, FT).getCallee());
+      continue;
+    }
+
+    // Debug names, export names and f<index> otherwise
+    std::string Name;
+    if (FunctionNames.count(i)) {
+      Name = FunctionNames[i];
+    } else {
+      for (auto &Export : Exports) {
+        if (Export.Kind == WASM_EXTERNAL_FUNCTION && Export.Index == i) {
+          Name = Export.Name;
+          break;
+        }
+      }
+    }
+    Name = Name.empty() ? Prefix + "f" + std::to_string(i)
+                        : mangleName(Prefix, Name);
+    if (ExportNames.count(Name)) {
+      Name += "_0";
+    }
+
+    Func.F = Function::Create(FT, GlobalValue::InternalLinkage, Name, *M);
+    Func.F->getArg(0)->setName("instance");
+  }
+}
+
+Value *WasmLifter::getImportInstance(IRBuilder<> &B, Value *Instance,
+                                     const WasmImport &Import) {
+  auto Ptr =
+      B.CreateStructGEP(InstanceTy, Instance, ImportModuleFields[Import.Module]);
+  return B.CreateLoad(PtrTy, Ptr, "w2c_" + Import.Module + "_instance");
+}
+
+Value *WasmLifter::getGlobalPtr(IRBuilder<> &B, Value *Instance,
+                                uint32_t Index) {
+  auto &Global = Globals[Index];
+  auto Ptr = B.CreateStructGEP(InstanceTy, Instance, Global.Field);
+  if (Global.Imported) {
+    return B.CreateLoad(PtrTy, Ptr);
+  }
+  return Ptr;
+}
+
+Value *WasmLifter::getMemoryPtr(IRBuilder<> &B, Value *Instance,
+                                uint32_t Index) {
+  auto &Memory = Memories[Index];
+  auto Ptr = B.CreateStructGEP(InstanceTy, Instance, Memory.Field);
+  if (Memory.Imported) {
+    return B.CreateLoad(PtrTy, Ptr);
+  }
+  return Ptr;
+}
+
+Value *WasmLifter::getTablePtr(IRBuilder<> &B, Value *Instance,
+                               uint32_t Index) {
+  auto &Table = Tables[Index];
+  auto Ptr = B.CreateStructGEP(InstanceTy, Instance, Table.Field);
+  if (Table.Imported) {
+    return B.CreateLoad(PtrTy, Ptr);
+  }
+  return Ptr;
+}
+
+Value *WasmLifter::emitConstExpr(IRBuilder<> &B, Value *Instance,
+                                 const WasmConstExpr &Expr, Type *Ty) {
+  switch (Expr.Opcode) {
+  case 0x41:
+    return B.getInt32(Expr.Value);
+  case 0x42:
+    return B.getInt64(Expr.Value);
+  case 0x43:
+    return ConstantFP::get(
+        Context, APFloat(APFloat::IEEEsingle(), APInt(32, Expr.Value)));
+  case 0x44:
+    return ConstantFP::get(
+        Context, APFloat(APFloat::IEEEdouble(), APInt(64, Expr.Value)));
+  default:
+    return B.CreateLoad(Ty, getGlobalPtr(B, Instance, Expr.Value));
+  }
+}
+
+Function *WasmLifter::createInitFunction(StringRef Name) {
+  auto FT = FunctionType::get(Type::getVoidTy(Context), {PtrTy}, false);
+  auto F = Function::Create(FT, GlobalValue::InternalLinkage, Name, *M);
+  F->getArg(0)->setName("instance");
+  BasicBlock::Create(Context, "entry", F);
+  return F;
+}
+
+Function *WasmLifter::getImportAccessor(const WasmImport &Import) {
+  // The runtime provides the imported entities of env, e.g. w2c_env_memory
+  auto Name =
+      mangleName(mangleName("w2c_", Import.Module) + "_", Import.Field);
+  auto FT = FunctionType::get(PtrTy, {PtrTy}, false);
+  return cast<Function>(M->getOrInsertFunction(Name, FT).getCallee());
+}
+
+void WasmLifter::createExports() {
+  for (auto &Export : Exports) {
+    if (Export.Kind != WASM_EXTERNAL_FUNCTION) {
+      continue;
+    }
+
+    auto &Func = Funcs[Export.Index];
+    auto Target = Func.F;
+    auto FT = getFunctionType(Types[Func.Type], true);
+    auto F = Function::Create(FT, GlobalValue::ExternalLinkage,
+                              mangleName(Prefix, Export.Name), *M);
+    F->getArg(0)->setName("instance");
+
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", F));
+    SmallVector<Value *, 8> Args;
+    for (auto &Arg : F->args()) {
+      Args.push_back(&Arg);
+    }
+    if (Func.Imported) {
+      Args[0] = getImportInstance(B, F->getArg(0), Func.Import);
+    }
+
+    auto Call = B.CreateCall(Target, Args);
+    if (FT->getReturnType()->isVoidTy()) {
+      B.CreateRetVoid();
+    } else {
+      B.CreateRet(Call);
+    }
+  }
+}
+
+void WasmLifter::createInstantiate() {
+  auto VoidTy = Type::getVoidTy(Context);
+  auto I1Ty = Type::getInt1Ty(Context);
+  auto I32Ty = Type::getInt32Ty(Context);
+  auto I64Ty = Type::getInt64Ty(Context);
+
+  // The limits of imported memories and tables are read by the runtime
+  auto createLimit = [&](StringRef Kind, const WasmImport &Import,
+                         Type *Ty, uint64_t Value) {
+    auto Suffix =
+        mangleName(mangleName("", Import.Module) + "_", Import.Field);
+    new GlobalVariable(*M, Ty, true, GlobalValue::ExternalLinkage,
+                       ConstantInt::get(Ty, Value),
+                       InstantiatePrefix + Kind + "_" + Suffix);
+  };
+
+  // init_instance_import
+  SmallVector<Type *, 4> ImportParams(ImportModules.size() + 1, PtrTy);
+  auto ImportFT = FunctionType::get(VoidTy, ImportParams, false);
+  auto InitImports = Function::Create(ImportFT, GlobalValue::InternalLinkage,
+                                      "init_instance_import", *M);
+  {
+    auto Instance = InitImports->getArg(0);
+    IRBuilder<> B(BasicBlock::Create(Context, "entry", InitImports));
+    for (unsigned i = 0; i < ImportModules.size(); i++) {
+      auto Ptr = B.CreateStructGEP(InstanceTy, Instance,
+                                   ImportModuleFields[ImportModules[i]]);
+      B.CreateStore(InitImports->getArg(i + 1), Ptr);
+    }
+
+    auto storeImport = [&](const WasmImport &Import, unsigned Field) {
+      auto ImportInstance = getImportInstance(B, Instance, Import);
+      auto Ptr = B.CreateCall(getImportAccessor(Import), {ImportInstance});
+      B.CreateStore(Ptr, B.CreateStructGEP(InstanceTy, Instance, Field));
+    };
+
+    for (auto &Global : Globals) {
+      if (Global.Imported) {
+        storeImport(Global.Import, Global.Field);
+      }
+    }
+    for (auto &Memory : Memories) {
+      if (Memory.Imported) {
+        storeImport(Memory.Import, Memory.Field);
+        createLimit("min", Memory.Import, I64Ty, Memory.Limits.Min);
+        createLimit("max", Memory.Import, I64Ty,
+                    Memory.Limits.HasMax ? Memory.Limits.Max : 65536);
+        createLimit("is64", Memory.Import, Type::getInt8Ty(Context), 0);
+      }
+    }
+    for (auto &Table : Tables) {
+      if (Table.Imported) {
+        storeImport(Table.Import, Table.Field);
+        createLimit("min", Table.Import, I32Ty, Table.Limits.Min);
+        createLimit("max", Table.Import, I32Ty,
+                    Table.Limits.HasMax ? Table.Limits.Max : UINT32_MAX);
+      }
+    }
+    B.CreateRetVoid();
+  }
+
+  // init_globals
+  auto InitGlobals = createInitFunction("init_globals");
+  {
+    auto Instance = InitGlobals->getArg(0);
+    IRBuilder<> B(&InitGlobals->getEntryBlock());
+    for (uint32_t i = 0; i < Globals.size(); i++) {
+      auto &Global = Globals[i];
+      if (Global.Imported) {
+        continue;
+      }
+
+      auto Ty = getValueType(Global.Type);
+      auto Init = emitConstExpr(B, Instance, Global.Init, Ty);
+      B.CreateStore(Init, getGlobalPtr(B, Instance, i));
+    }
+    B.CreateRetVoid();
+  }
+
+  // init_tables, including the active element segments
+  auto InitTables = createInitFunction("init_tables");
+  {
+    auto Instance = InitTables->getArg(0);
+    IRBuilder<> B(&InitTables->getEntryBlock());
+    auto AllocateTable = M->getOrInsertFunction(
+        "wasm_rt_allocate_funcref_table",
+        FunctionType::get(VoidTy, {PtrTy, I32Ty, I32Ty}, false));
+
+    for (uint32_t i = 0; i < Tables.size(); i++) {
+      auto &Table = Tables[i];
+      if (Table.Imported) {
+        continue;
+      }
+
+      uint64_t Max = Table.Limits.HasMax ? Table.Limits.Max : UINT32_MAX;
+      B.CreateCall(AllocateTable, {getTablePtr(B, Instance, i),
+                                   B.getInt32(Table.Limits.Min),
+                                   B.getInt32(Max)});
+    }
+
+    for (auto &Segment : ElemSegments) {
+      auto Table = getTablePtr(B, Instance, Segment.Table);
+      auto Data =
+          B.CreateLoad(PtrTy, B.CreateStructGEP(TableTy, Table, 0), "data");
+      auto Offset = emitConstExpr(B, Instance, Segment.Offset, I32Ty);
+
+      for (unsigned j = 0; j < Segment.Functions.size(); j++) {
+        auto &Func = Funcs[Segment.Functions[j]];
+        auto Index = B.CreateZExt(B.CreateAdd(Offset, B.getInt32(j)), I64Ty);
+        auto Elem = B.CreateGEP(FuncRefTy, Data, Index);
+
+        // The function types are not checked, leave them empty
+        Value *FuncInstance = Func.Imported
+                                  ? getImportInstance(B, Instance, Func.Import)
+                                  : (Value *)Instance;
+        B.CreateStore(ConstantPointerNull::get(PtrTy),
+                      B.CreateStructGEP(FuncRefTy, Elem, 0));
+        B.CreateStore(Func.F, B.CreateStructGEP(FuncRefTy, Elem, 1));
+        B.CreateStore(ConstantPointerNull::get(PtrTy),
+                      B.CreateStructGEP(FuncRefTy, Elem, 2));
+        B.CreateStore(FuncInstance, B.CreateStructGEP(FuncRefTy, Elem, 3));
+      }
+    }
+    B.CreateRetVoid();
+  }
+
+  // init_memories, including the active data segments
+  auto InitMemories = createInitFunction("init_memories");
+  {
+    auto Instance = InitMemories->getArg(0);
+    IRBuilder<> B(&InitMemories->getEntryBlock());
+    auto AllocateMemory = M->getOrInsertFunction(
+        "wasm_rt_allocate_memory",
+        FunctionType::get(VoidTy, {PtrTy, I64Ty, I64Ty, I1Ty}, false));
+
+    for (uint32_t i = 0; i < Memories.size(); i++) {
+      auto &Memory = Memories[i];
+      if (Memory.Imported) {
+        continue;
+      }
+
+      uint64_t Max = Memory.Limits.HasMax ? Memory.Limits.Max : 65536;
+      B.CreateCall(AllocateMemory,
+                   {getMemoryPtr(B, Instance, i), B.getInt64(Memory.Limits.Min),
+                    B.getInt64(Max), B.getInt1(false)});
+    }
+
+    for (unsigned i = 0; i < DataSegments.size(); i++) {
+      auto &Segment = DataSegments[i];
+      if (!Segment.Active || Segment.Bytes.empty()) {
+        continue;
+      }
+
+      auto Init = ConstantDataArray::getString(Context, Segment.Bytes, false);
+      auto Data = new GlobalVariable(
+          *M, Init->getType(), true, GlobalValue::InternalLinkage, Init,
+          "data_segment_data_" + Prefix + "d" + std::to_string(i));
+
+      auto Memory = getMemoryPtr(B, Instance, 0);
+      auto Base =
+          B.CreateLoad(PtrTy, B.CreateStructGEP(MemoryTy, Memory, 0), "data");
+      auto Offset = B.CreateZExt(
+          emitConstExpr(B, Instance, Segment.Offset, I32Ty), I64Ty);
+      B.CreateMemCpy(B.CreateGEP(B.getInt8Ty(), Base, Offset), MaybeAlign(1),
+                     Data, MaybeAlign(1), Segment.Bytes.size());
+    }
+    B.CreateRetVoid();
+  }
+
+  // wasm2c_<module>_instantiate(instance, env, ...)
+  auto F = Function::Create(ImportFT, GlobalValue::ExternalLinkage,
+                            InstantiatePrefix + "instantiate", *M);
+  F->getArg(0)->setName("instance");
+  for (unsigned i = 0; i < ImportModules.size(); i++) {
+    F->getArg(i + 1)->setName(mangleName("w2c_", ImportModules[i]) +
+                              "_instance");
+  }
+
+  IRBuilder<> B(BasicBlock::Create(Context, "entry", F));
+  SmallVector<Value *, 4> Args;
+  for (auto &Arg : F->args()) {
+    Args.push_back(&Arg);
+  }
+  B.CreateCall(InitImports, Args);
+  B.CreateCall(InitGlobals, {F->getArg(0)});
+  B.CreateCall(InitTables, {F->getArg(0)});
+  B.CreateCall(InitMemories, {F->getArg(0)});
+
+  if (StartFunction >= 0) {
+    auto &Start = Funcs[StartFunction];
+    Value *StartInstance = Start.Imported
+                               ? getImportInstance(B, F->getArg(0), Start.Import)
+                               : (Value *)F->getArg(0);
+    B.CreateCall(Start.F, {StartInstance});
+  }
+  B.CreateRetVoid();
+}
+
+Expected<std::unique_ptr<Module>> WasmLifter::lift() {
+  WasmReader R(Buffer.getBuffer());
+  if (R.readBytes(4) != StringRef("\0asm", 4) || R.readFixed(4) != 1) {
+    return make_error<StringError>("not a version 1 wasm binary",
+                                   inconvertibleErrorCode());
+  }
+
+  // The sections refer to each other, parse all of them first
+  while (!R.empty()) {
+    uint8_t Id = R.readByte();
+    WasmReader Section(R.readName());
+    if (R.failed()) {
+      fail("truncated section");
+      break;
+    }
+
+    if (!parseSection(Id, Section)) {
+      break;
+    }
+    if (Section.failed()) {
+      fail(formatv("malformed section {0}", Id));
+      break;
+    }
+  }
+
+  if (ErrorMessage.empty()) {
+    for (auto &Func : Funcs) {
+      if (!Func.Imported && Func.Body.empty()) {
+        fail("function without body");
+        break;
+      }
+    }
+  }
+
+  if (ErrorMessage.empty()) {
+    createTypes();
+    declareFunctions();
+  }
+
+  for (uint32_t i = 0; i < Funcs.size() && ErrorMessage.empty(); i++) {
+    if (!Funcs[i].Imported) {
+      FunctionLifter(*this, i).lift();
+    }
+  }
+
+  if (ErrorMessage.empty()) {
+    createExports();
+    createInstantiate();
+  }
+
+  if (!ErrorMessage.empty()) {
+    return make_error<StringError>(ErrorMessage, inconvertibleErrorCode());
+  }
+
+  std::string Message;
+  raw_string_ostream OS(Message);
+  if (verifyModule(*M, &OS)) {
+    return make_error<StringError>("the lifted module is broken: " + OS.str(),
+                                   inconvertibleErrorCode());
+  }
+
+  return std::move(M);
+}
+
+Value *FunctionLifter::pop(Type *Ty) {
+  auto &Top = Frames.back();
+  if (Stack.size() <= Top.Height) {
+    // The stack is polymorphic after an unconditional branch
+    if (Top.Unreachable) {
+      return PoisonValue::get(Ty ? Ty : B.getInt32Ty());
+    }
+
+    fail("operand stack underflow");
+    return nullptr;
+  }
+
+  auto V = Stack.pop_back_val();
+  if (Ty && V->getType() != Ty) {
+    fail("operand type mismatch");
+    return nullptr;
+  }
+  return V;
+}
+
+bool FunctionLifter::popValues(ArrayRef<Type *> Types,
+                               SmallVectorImpl<Value *> &Values) {
+  Values.resize(Types.size());
+  for (size_t i = Types.size(); i > 0; i--) {
+    Values[i - 1] = pop(Types[i - 1]);
+    if (!Values[i - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FunctionLifter::pushResults(Value *Result, const WasmFuncType &FT) {
+  if (FT.Results.size() == 1) {
+    push(Result);
+  } else {
+    for (unsigned i = 0; i < FT.Results.size(); i++) {
+      push(B.CreateExtractValue(Result, i));
+    }
+  }
+  return true;
+}
+
+bool FunctionLifter::readBlockType(WasmReader &R,
+                                   SmallVectorImpl<Type *> &Params,
+                                   SmallVectorImpl<Type *> &Results) {
+  uint8_t Byte = R.peekByte();
+  if (Byte == 0x40) {
+    R.readByte();
+    return true;
+  }
+
+  // Single value types are encoded as negative type indices
+  if (Byte >= 0x40 && Byte < 0x80) {
+    R.readByte();
+    auto Ty = L.getValueType(Byte);
+    if (!Ty) {
+      return false;
+    }
+    Results.push_back(Ty);
+    return true;
+  }
+
+  int64_t TypeIndex = R.readSLEB();
+  if (TypeIndex < 0 || TypeIndex >= (int64_t)L.Types.size()) {
+    return fail("block references an unknown type");
+  }
+
+  auto &FT = L.Types[TypeIndex];
+  for (auto Param : FT.Params) {
+    Params.push_back(L.getValueType(Param));
+  }
+  for (auto Result : FT.Results) {
+    Results.push_back(L.getValueType(Result));
+  }
+  return true;
+}
+
+FunctionLifter::Frame &FunctionLifter::createFrame(FrameKind Kind,
+                                                   ArrayRef<Type *> Params,
+                                                   ArrayRef<Type *> Results,
+                                                   const Twine &Name) {
+  Frame Fr;
+  Fr.Kind = Kind;
+  Fr.Params.assign(Params.begin(), Params.end());
+  Fr.Results.assign(Results.begin(), Results.end());
+  Fr.End = BasicBlock::Create(L.Context, Name + ".end", F);
+  Fr.Target = Fr.End;
+  Fr.Height = Stack.size();
+
+  for (auto Ty : Results) {
+    Fr.EndPHIs.push_back(PHINode::Create(Ty, 2, "", Fr.End));
+  }
+
+  Frames.push_back(std::move(Fr));
+  return Frames.back();
+}
+
+void FunctionLifter::addIncoming(ArrayRef<PHINode *> PHIs,
+                                 ArrayRef<Value *> Values, BasicBlock *From) {
+  for (unsigned i = 0; i < PHIs.size(); i++) {
+    PHIs[i]->addIncoming(Values[i], From);
+  }
+}
+
+bool FunctionLifter::branch(uint32_t Depth) {
+  if (Depth >= Frames.size()) {
+    return fail("branch to an unknown label");
+  }
+
+  auto &Target = Frames[Frames.size() - 1 - Depth];
+  SmallVector<Value *, 2> Values;
+  if (!popValues(getLabelTypes(Target), Values)) {
+    return false;
+  }
+
+  addIncoming(getLabelPHIs(Target), Values, B.GetInsertBlock());
+  B.CreateBr(Target.Target);
+  return true;
+}
+
+void FunctionLifter::markUnreachable() {
+  auto &Top = Frames.back();
+  Stack.resize(Top.Height);
+  Top.Unreachable = true;
+
+  // Code following a branch is still lifted, it is removed afterwards
+  B.SetInsertPoint(BasicBlock::Create(L.Context, "unreachable", F));
+}
+
+void FunctionLifter::trapIf(Value *Cond) {
+  if (!TrapBlock) {
+    TrapBlock = BasicBlock::Create(L.Context, "trap", F);
+    IRBuilder<> TrapBuilder(TrapBlock);
+    TrapBuilder.CreateCall(
+        Intrinsic::getDeclaration(L.M.get(), Intrinsic::trap));
+    TrapBuilder.CreateUnreachable();
+  }
+
+  auto Cont = BasicBlock::Create(L.Context, "trap.cont", F);
+  B.CreateCondBr(Cond, TrapBlock, Cont);
+  B.SetInsertPoint(Cont);
+}
+
+bool FunctionLifter::exitFrame(Frame &Fr) {
+  SmallVector<Value *, 2> Values;
+  if (!popValues(Fr.Results, Values)) {
+    return false;
+  }
+
+  if (Stack.size() != Fr.Height) {
+    return fail("values left on the operand stack");
+  }
+
+  addIncoming(Fr.EndPHIs, Values, B.GetInsertBlock());
+  B.CreateBr(Fr.End);
+  return true;
+}
+
+void FunctionLifter::terminateUnreachable() {
+  if (!B.GetInsertBlock()->getTerminator()) {
+    B.CreateUnreachable();
+  }
+}
+
+bool FunctionLifter::endFrame() {
+  auto &Fr = Frames.back();
+  if (Fr.Unreachable) {
+    terminateUnreachable();
+  } else if (!exitFrame(Fr)) {
+    return false;
+  }
+
+  // An if without else passes its params through
+  if (Fr.Else) {
+    IRBuilder<> ElseB(Fr.Else);
+    addIncoming(Fr.EndPHIs, Fr.IfParams, Fr.Else);
+    ElseB.CreateBr(Fr.End);
+  }
+
+  Stack.resize(Fr.Height);
+  B.SetInsertPoint(Fr.End);
+  for (auto PHI : Fr.EndPHIs) {
+    push(PHI);
+  }
+
+  if (Fr.Kind == FrameKind::Function) {
+    auto RetTy = F->getReturnType();
+    if (RetTy->isVoidTy()) {
+      B.CreateRetVoid();
+    } else if (Fr.EndPHIs.size() == 1) {
+      B.CreateRet(Fr.EndPHIs[0]);
+    } else {
+      Value *Result = PoisonValue::get(RetTy);
+      for (unsigned i = 0; i < Fr.EndPHIs.size(); i++) {
+        Result = B.CreateInsertValue(Result, Fr.EndPHIs[i], i);
+      }
+      B.CreateRet(Result);
+    }
+  }
+
+  Frames.pop_back();
+  return true;
+}
+
+Value *FunctionLifter::getMemoryAddress(Value *Address, uint64_t Offset) {
+  if (L.Memories.empty()) {
+    fail("memory access without a memory");
+    return nullptr;
+  }
+
+  // MEM_ADDR(mem, addr, n) = mem->data + addr, the bounds are not checked
+  auto Memory = L.getMemoryPtr(B, Instance, 0);
+  auto Data = B.CreateLoad(L.PtrTy, B.CreateStructGEP(L.MemoryTy, Memory, 0));
+  Value *Index = B.CreateZExt(Address, B.getInt64Ty());
+  if (Offset) {
+    Index = B.CreateAdd(Index, B.getInt64(Offset));
+  }
+  return B.CreateGEP(B.getInt8Ty(), Data, Index);
+}
+
+Value *FunctionLifter::getAddress(WasmReader &R, Value *Address) {
+  uint32_t Align = R.readU32();
+  if (Align & 0x40) {
+    fail("multiple memories are not supported");
+    return nullptr;
+  }
+
+  uint64_t Offset = R.readULEB();
+  if (!Address) {
+    return nullptr;
+  }
+  return getMemoryAddress(Address, Offset);
+}
+
+Value *FunctionLifter::callIntrinsic(Intrinsic::ID ID, ArrayRef<Type *> Types,
+                                     ArrayRef<Value *> Args) {
+  auto Callee = Intrinsic::getDeclaration(L.M.get(), ID, Types);
+  return B.CreateCall(Callee, Args);
+}
+
+bool FunctionLifter::liftNumeric(uint8_t Opcode) {
+  auto I32Ty = B.getInt32Ty();
+  auto I64Ty = B.getInt64Ty();
+  auto F32Ty = B.getFloatTy();
+  auto F64Ty = B.getDoubleTy();
+
+  // eqz
+  if (Opcode == 0x45 || Opcode == 0x50) {
+    auto V = pop(Opcode == 0x45 ? I32Ty : I64Ty);
+    if (!V) {
+      return false;
+    }
+    push(B.CreateZExt(B.CreateIsNull(V), I32Ty));
+    return true;
+  }
+
+  // Integer comparisons
+  if ((Opcode >= 0x46 && Opcode <= 0x4F) || (Opcode >= 0x51 && Opcode <= 0x5A)) {
+    static const CmpInst::Predicate Predicates[] = {
+        CmpInst::ICMP_EQ,  CmpInst::ICMP_NE,  CmpInst::ICMP_SLT,
+        CmpInst::ICMP_ULT, CmpInst::ICMP_SGT, CmpInst::ICMP_UGT,
+        CmpInst::ICMP_SLE, CmpInst::ICMP_ULE, CmpInst::ICMP_SGE,
+        CmpInst::ICMP_UGE};
+    auto Ty = Opcode <= 0x4F ? I32Ty : I64Ty;
+    auto Pred = Predicates[Opcode - (Opcode <= 0x4F ? 0x46 : 0x51)];
+    auto RHS = pop(Ty);
+    auto LHS = RHS ? pop(Ty) : nullptr;
+    if (!LHS) {
+      return false;
+    }
+    push(B.CreateZExt(B.CreateICmp(Pred, LHS, RHS), I32Ty));
+    return true;
+  }
+
+  // Float comparisons
+  if (Opcode >= 0x5B && Opcode <= 0x66) {
+    static const CmpInst::Predicate Predicates[] = {
+        CmpInst::FCMP_OEQ, CmpInst::FCMP_UNE, CmpInst::FCMP_OLT,
+        CmpInst::FCMP_OGT, CmpInst::FCMP_OLE, CmpInst::FCMP_OGE};
+    auto Ty = Opcode <= 0x60 ? F32Ty : F64Ty;
+    auto Pred = Predicates[Opcode - (Opcode <= 0x60 ? 0x5B : 0x61)];
+    auto RHS = pop(Ty);
+    auto LHS = RHS ? pop(Ty) : nullptr;
+    if (!LHS) {
+      return false;
+    }
+    push(B.CreateZExt(B.CreateFCmp(Pred, LHS, RHS), I32Ty));
+    return true;
+  }
+
+  // Integer arithmetic
+  if (Opcode >= 0x67 && Opcode <= 0x8A) {
+    auto Ty = Opcode <= 0x78 ? I32Ty : I64Ty;
+    unsigned Op = Opcode - (Opcode <= 0x78 ? 0x67 : 0x79);
+
+    // clz, ctz, popcnt
+    if (Op <= 2) {
+      auto V = pop(Ty);
+      if (!V) {
+        return false;
+      }
+      if (Op == 2) {
+        push(callIntrinsic(Intrinsic::ctpop, {Ty}, {V}));
+      } else {
+        auto ID = Op == 0 ? Intrinsic::ctlz : Intrinsic::cttz;
+        push(callIntrinsic(ID, {Ty}, {V, B.getFalse()}));
+      }
+      return true;
+    }
+
+    auto RHS = pop(Ty);
+    auto LHS = RHS ? pop(Ty) : nullptr;
+    if (!LHS) {
+      return false;
+    }
+
+    // Shift counts are taken modulo the bit width
+    auto ShiftMask = ConstantInt::get(Ty, Ty->getIntegerBitWidth() - 1);
+
+    // Division by zero and signed overflow trap like in wasm2c, unlike the
+    // bounds of memory accesses these checks are kept
+    if (Op >= 6 && Op <= 9) {
+      trapIf(B.CreateIsNull(RHS));
+    }
+
+    auto MinusOne = Constant::getAllOnesValue(Ty);
+    auto SignedMin = ConstantInt::get(
+        Ty, APInt::getSignedMinValue(Ty->getIntegerBitWidth()));
+    if (Op == 6) {
+      trapIf(B.CreateAnd(B.CreateICmpEQ(LHS, SignedMin),
+                         B.CreateICmpEQ(RHS, MinusOne)));
+    }
+
+    switch (Op) {
+    case 3:
+      push(B.CreateAdd(LHS, RHS));
+      break;
+    case 4:
+      push(B.CreateSub(LHS, RHS));
+      break;
+    case 5:
+      push(B.CreateMul(LHS, RHS));
+      break;
+    case 6:
+      push(B.CreateSDiv(LHS, RHS));
+      break;
+    case 7:
+      push(B.CreateUDiv(LHS, RHS));
+      break;
+    case 8:
+      // INT_MIN % -1 is 0 in wasm but overflows in LLVM, x % -1 == x % 1
+      push(B.CreateSRem(LHS, B.CreateSelect(B.CreateICmpEQ(RHS, MinusOne),
+                                            ConstantInt::get(Ty, 1), RHS)));
+      break;
+    case 9:
+      push(B.CreateURem(LHS, RHS));
+      break;
+    case 10:
+      push(B.CreateAnd(LHS, RHS));
+      break;
+    case 11:
+      push(B.CreateOr(LHS, RHS));
+      break;
+    case 12:
+      push(B.CreateXor(LHS, RHS));
+      break;
+    case 13:
+      push(B.CreateShl(LHS, B.CreateAnd(RHS, ShiftMask)));
+      break;
+    case 14:
+      push(B.CreateAShr(LHS, B.CreateAnd(RHS, ShiftMask)));
+      break;
+    case 15:
+      push(B.CreateLShr(LHS, B.CreateAnd(RHS, ShiftMask)));
+      break;
+    case 16:
+      push(callIntrinsic(Intrinsic::fshl, {Ty}, {LHS, LHS, RHS}));
+      break;
+    case 17:
+      push(callIntrinsic(Intrinsic::fshr, {Ty}, {LHS, LHS, RHS}));
+      break;
+    }
+    return true;
+  }
+
+  // Float arithmetic
+  if (Opcode >= 0x8B && Opcode <= 0xA6) {
+    auto Ty = Opcode <= 0x98 ? F32Ty : F64Ty;
+    unsigned Op = Opcode - (Opcode <= 0x98 ? 0x8B : 0x99);
+
+    // abs, neg, ceil, floor, trunc, nearest, sqrt
+    if (Op <= 6) {
+      static const Intrinsic::ID Unary[] = {
+          Intrinsic::fabs,  Intrinsic::not_intrinsic, Intrinsic::ceil,
+          Intrinsic::floor, Intrinsic::trunc,         Intrinsic::roundeven,
+          Intrinsic::sqrt};
+      auto V = pop(Ty);
+      if (!V) {
+        return false;
+      }
+      push(Op == 1 ? B.CreateFNeg(V) : callIntrinsic(Unary[Op], {Ty}, {V}));
+      return true;
+    }
+
+    auto RHS = pop(Ty);
+    auto LHS = RHS ? pop(Ty) : nullptr;
+    if (!LHS) {
+      return false;
+    }
+
+    switch (Op) {
+    case 7:
+      push(B.CreateFAdd(LHS, RHS));
+      break;
+    case 8:
+      push(B.CreateFSub(LHS, RHS));
+      break;
+    case 9:
+      push(B.CreateFMul(LHS, RHS));
+      break;
+    case 10:
+      push(B.CreateFDiv(LHS, RHS));
+      break;
+    case 11:
+      push(callIntrinsic(Intrinsic::minimum, {Ty}, {LHS, RHS}));
+      break;
+    case 12:
+      push(callIntrinsic(Intrinsic::maximum, {Ty}, {LHS, RHS}));
+      break;
+    case 13:
+      push(callIntrinsic(Intrinsic::copysign, {Ty}, {LHS, RHS}));
+      break;
+    }
+    return true;
+  }
+
+  // Conversions
+  if (Opcode >= 0xA7 && Opcode <= 0xBF) {
+    static const struct {
+      uint8_t From;
+      uint8_t To;
+      Instruction::CastOps Op;
+    } Conversions[] = {
+        {WASM_I64, WASM_I32, Instruction::Trunc},
+        {WASM_F32, WASM_I32, Instruction::FPToSI},
+        {WASM_F32, WASM_I32, Instruction::FPToUI},
+        {WASM_F64, WASM_I32, Instruction::FPToSI},
+        {WASM_F64, WASM_I32, Instruction::FPToUI},
+        {WASM_I32, WASM_I64, Instruction::SExt},
+        {WASM_I32, WASM_I64, Instruction::ZExt},
+        {WASM_F32, WASM_I64, Instruction::FPToSI},
+        {WASM_F32, WASM_I64, Instruction::FPToUI},
+        {WASM_F64, WASM_I64, Instruction::FPToSI},
+        {WASM_F64, WASM_I64, Instruction::FPToUI},
+        {WASM_I32, WASM_F32, Instruction::SIToFP},
+        {WASM_I32, WASM_F32, Instruction::UIToFP},
+        {WASM_I64, WASM_F32, Instruction::SIToFP},
+        {WASM_I64, WASM_F32, Instruction::UIToFP},
+        {WASM_F64, WASM_F32, Instruction::FPTrunc},
+        {WASM_I32, WASM_F64, Instruction::SIToFP},
+        {WASM_I32, WASM_F64, Instruction::UIToFP},
+        {WASM_I64, WASM_F64, Instruction::SIToFP},
+        {WASM_I64, WASM_F64, Instruction::UIToFP},
+        {WASM_F32, WASM_F64, Instruction::FPExt},
+        {WASM_F32, WASM_I32, Instruction::BitCast},
+        {WASM_F64, WASM_I64, Instruction::BitCast},
+        {WASM_I32, WASM_F32, Instruction::BitCast},
+        {WASM_I64, WASM_F64, Instruction::BitCast},
+    };
+    auto &Conversion = Conversions[Opcode - 0xA7];
+    auto V = pop(L.getValueType(Conversion.From));
+    if (!V) {
+      return false;
+    }
+
+    // NaN and values out of range trap with the wasm2c bounds, the
+    // saturating truncations are lifted in liftPrefixed
+    if (Conversion.Op == Instruction::FPToSI ||
+        Conversion.Op == Instruction::FPToUI) {
+      auto Ty = V->getType();
+      unsigned Bits = L.getValueType(Conversion.To)->getIntegerBitWidth();
+      Value *AboveMin, *BelowMax;
+      if (Conversion.Op == Instruction::FPToSI) {
+        // -2^31 - 1 is exact as a double only, everything above it
+        // truncates to a valid i32
+        if (Ty->isDoubleTy() && Bits == 32) {
+          AboveMin = B.CreateFCmpOGT(V, ConstantFP::get(Ty, -2147483649.0));
+        } else {
+          AboveMin = B.CreateFCmpOGE(
+              V, ConstantFP::get(Ty, -std::ldexp(1.0, Bits - 1)));
+        }
+        BelowMax =
+            B.CreateFCmpOLT(V, ConstantFP::get(Ty, std::ldexp(1.0, Bits - 1)));
+      } else {
+        AboveMin = B.CreateFCmpOGT(V, ConstantFP::get(Ty, -1.0));
+        BelowMax =
+            B.CreateFCmpOLT(V, ConstantFP::get(Ty, std::ldexp(1.0, Bits)));
+      }
+      trapIf(B.CreateNot(B.CreateAnd(AboveMin, BelowMax)));
+    }
+
+    push(B.CreateCast(Conversion.Op, V, L.getValueType(Conversion.To)));
+    return true;
+  }
+
+  // Sign extensions
+  if (Opcode >= 0xC0 && Opcode <= 0xC4) {
+    static const unsigned Widths[] = {8, 16, 8, 16, 32};
+    auto Ty = Opcode <= 0xC1 ? I32Ty : I64Ty;
+    auto V = pop(Ty);
+    if (!V) {
+      return false;
+    }
+    auto Narrow = B.CreateTrunc(V, B.getIntNTy(Widths[Opcode - 0xC0]));
+    push(B.CreateSExt(Narrow, Ty));
+    return true;
+  }
+
+  return fail(formatv("unsupported opcode {0:x}", Opcode));
+}
+
+bool FunctionLifter::liftPrefixed(WasmReader &R) {
+  uint32_t Opcode = R.readU32();
+
+  // Saturating truncations
+  if (Opcode <= 7) {
+    auto From = (Opcode & 2) ? B.getDoubleTy() : B.getFloatTy();
+    auto To = (Opcode & 4) ? B.getInt64Ty() : B.getInt32Ty();
+    auto ID = (Opcode & 1) ? Intrinsic::fptoui_sat : Intrinsic::fptosi_sat;
+    auto V = pop(From);
+    if (!V) {
+      return false;
+    }
+    push(callIntrinsic(ID, {To, From}, {V}));
+    return true;
+  }
+
+  // memory.copy
+  if (Opcode == 10) {
+    if (R.readByte() != 0 || R.readByte() != 0) {
+      return fail("multiple memories are not supported");
+    }
+    auto Size = pop(B.getInt32Ty());
+    auto Src = Size ? pop(B.getInt32Ty()) : nullptr;
+    auto Dst = Src ? pop(B.getInt32Ty()) : nullptr;
+    if (!Dst) {
+      return false;
+    }
+    auto DstPtr = getMemoryAddress(Dst, 0);
+    auto SrcPtr = DstPtr ? getMemoryAddress(Src, 0) : nullptr;
+    if (!SrcPtr) {
+      return false;
+    }
+    B.CreateMemMove(DstPtr, MaybeAlign(1), SrcPtr, MaybeAlign(1),
+                    B.CreateZExt(Size, B.getInt64Ty()));
+    return true;
+  }
+
+  // memory.fill
+  if (Opcode == 11) {
+    if (R.readByte() != 0) {
+      return fail("multiple memories are not supported");
+    }
+    auto Size = pop(B.getInt32Ty());
+    auto Value = Size ? pop(B.getInt32Ty()) : nullptr;
+    auto Dst = Value ? pop(B.getInt32Ty()) : nullptr;
+    if (!Dst) {
+      return false;
+    }
+    auto DstPtr = getMemoryAddress(Dst, 0);
+    if (!DstPtr) {
+      return false;
+    }
+    B.CreateMemSet(DstPtr, B.CreateTrunc(Value, B.getInt8Ty()),
+                   B.CreateZExt(Size, B.getInt64Ty()), MaybeAlign(1));
+    return true;
+  }
+
+  return fail(formatv("unsupported opcode fc {0}", Opcode));
+}
+
+bool FunctionLifter::lift(WasmReader &R, uint8_t Opcode) {
+  auto I32Ty = B.getInt32Ty();
+
+  switch (Opcode) {
+  case 0x00: // unreachable
+    callIntrinsic(Intrinsic::trap, {}, {});
+    B.CreateUnreachable();
+    markUnreachable();
+    return true;
+
+  case 0x01: // nop
+    return true;
+
+  case 0x02: // block
+  case 0x03: // loop
+  case 0x04: // if
+  {
+    SmallVector<Type *, 1> Params, Results;
+    if (!readBlockType(R, Params, Results)) {
+      return false;
+    }
+
+    Value *Cond = nullptr;
+    if (Opcode == 0x04 && !(Cond = pop(I32Ty))) {
+      return false;
+    }
+
+    SmallVector<Value *, 1> Args;
+    if (!popValues(Params, Args)) {
+      return false;
+    }
+
+    if (Opcode == 0x02) {
+      createFrame(FrameKind::Block, Params, Results, "block");
+      Stack.append(Args.begin(), Args.end());
+      return true;
+    }
+
+    if (Opcode == 0x03) {
+      auto &Fr = createFrame(FrameKind::Loop, Params, Results, "loop");
+      auto Pred = B.GetInsertBlock();
+      Fr.Target = BasicBlock::Create(L.Context, "loop", F, Fr.End);
+      B.CreateBr(Fr.Target);
+      B.SetInsertPoint(Fr.Target);
+
+      for (unsigned i = 0; i < Params.size(); i++) {
+        auto PHI = B.CreatePHI(Params[i], 2);
+        PHI->addIncoming(Args[i], Pred);
+        Fr.LoopPHIs.push_back(PHI);
+        push(PHI);
+      }
+      return true;
+    }
+
+    auto &Fr = createFrame(FrameKind::If, Params, Results, "if");
+    auto Then = BasicBlock::Create(L.Context, "if.then", F, Fr.End);
+    Fr.Else = BasicBlock::Create(L.Context, "if.else", F, Fr.End);
+    Fr.IfParams.assign(Args.begin(), Args.end());
+    B.CreateCondBr(B.CreateICmpNE(Cond, B.getInt32(0)), Then, Fr.Else);
+    B.SetInsertPoint(Then);
+    Stack.append(Args.begin(), Args.end());
+    return true;
+  }
+
+  case 0x05: // else
+  {
+    auto &Fr = Frames.back();
+    if (Fr.Kind != FrameKind::If || !Fr.Else) {
+      return fail("else without if");
+    }
+
+    if (Fr.Unreachable) {
+      terminateUnreachable();
+    } else if (!exitFrame(Fr)) {
+      return false;
+    }
+
+    Stack.resize(Fr.Height);
+    Stack.append(Fr.IfParams.begin(), Fr.IfParams.end());
+    Fr.Unreachable = false;
+    B.SetInsertPoint(Fr.Else);
+    Fr.Else = nullptr;
+    return true;
+  }
+
+  case 0x0B: // end
+    return endFrame();
+
+  case 0x0C: // br
+    if (!branch(R.readU32())) {
+      return false;
+    }
+    markUnreachable();
+    return true;
+
+  case 0x0D: // br_if
+  {
+    uint32_t Depth = R.readU32();
+    if (Depth >= Frames.size()) {
+      return fail("branch to an unknown label");
+    }
+
+    auto Cond = pop(I32Ty);
+    auto &Target = Frames[Frames.size() - 1 - Depth];
+    SmallVector<Value *, 2> Values;
+    if (!Cond || !popValues(getLabelTypes(Target), Values)) {
+      return false;
+    }
+
+    auto Cont = BasicBlock::Create(L.Context, "br_if.cont", F);
+    addIncoming(getLabelPHIs(Target), Values, B.GetInsertBlock());
+    B.CreateCondBr(B.CreateICmpNE(Cond, B.getInt32(0)), Target.Target, Cont);
+    B.SetInsertPoint(Cont);
+    Stack.append(Values.begin(), Values.end());
+    return true;
+  }
+
+  case 0x0E: // br_table
+  {
+    SmallVector<uint32_t, 16> Depths;
+    uint32_t Count = R.readU32();
+    for (uint32_t i = 0; i <= Count && !R.failed(); i++) {
+      Depths.push_back(R.readU32());
+      if (Depths.back() >= Frames.size()) {
+        return fail("branch to an unknown label");
+      }
+    }
+    if (R.failed()) {
+      return fail("truncated br_table");
+    }
+
+    auto Index = pop(I32Ty);
+    auto &Default = Frames[Frames.size() - 1 - Depths.back()];
+    SmallVector<Value *, 2> Values;
+    if (!Index || !popValues(getLabelTypes(Default), Values)) {
+      return false;
+    }
+
+    // Every edge needs its own phi entry, even for repeated targets
+    auto From = B.GetInsertBlock();
+    auto Switch = B.CreateSwitch(Index, Default.Target, Count);
+    addIncoming(getLabelPHIs(Default), Values, From);
+    for (uint32_t i = 0; i < Count; i++) {
+      auto &Target = Frames[Frames.size() - 1 - Depths[i]];
+      Switch->addCase(B.getInt32(i), Target.Target);
+      addIncoming(getLabelPHIs(Target), Values, From);
+    }
+
+    markUnreachable();
+    return true;
+  }
+
+  case 0x0F: // return
+    if (!branch(Frames.size() - 1)) {
+      return false;
+    }
+    markUnreachable();
+    return true;
+
+  case 0x10: // call
+  {
+    uint32_t Callee = R.readU32();
+    if (Callee >= L.Funcs.size()) {
+      return fail("call to an unknown function");
+    }
+
+    auto &Target = L.Funcs[Callee];
+    auto &FT = L.Types[Target.Type];
+    auto CalleeTy = Target.F->getFunctionType();
+
+    SmallVector<Value *, 8> Args;
+    if (!popValues(CalleeTy->params().drop_front(), Args)) {
+      return false;
+    }
+
+    Value *CalleeInstance = Target.Imported
+                                ? L.getImportInstance(B, Instance, Target.Import)
+                                : Instance;
+    Args.insert(Args.begin(), CalleeInstance);
+    return pushResults(B.CreateCall(Target.F, Args), FT);
+  }
+
+  case 0x11: // call_indirect
+  {
+    uint32_t TypeIndex = R.readU32();
+    uint32_t TableIndex = R.readU32();
+    if (TypeIndex >= L.Types.size() || TableIndex >= L.Tables.size()) {
+      return fail("call_indirect references an unknown type or table");
+    }
+
+    auto &FT = L.Types[TypeIndex];
+    auto CalleeTy = L.getFunctionType(FT, true);
+    auto Index = pop(I32Ty);
+    SmallVector<Value *, 8> Args;
+    if (!Index || !popValues(CalleeTy->params().drop_front(), Args)) {
+      return false;
+    }
+
+    // DO_CALL_INDIRECT: table.data[x].func(table.data[x].module_instance, ...)
+    // without the bounds and signature checks
+    auto Table = L.getTablePtr(B, Instance, TableIndex);
+    auto Data = B.CreateLoad(L.PtrTy, B.CreateStructGEP(L.TableTy, Table, 0));
+    auto Elem =
+        B.CreateGEP(L.FuncRefTy, Data, B.CreateZExt(Index, B.getInt64Ty()));
+    auto Callee =
+        B.CreateLoad(L.PtrTy, B.CreateStructGEP(L.FuncRefTy, Elem, 1));
+    auto CalleeInstance =
+        B.CreateLoad(L.PtrTy, B.CreateStructGEP(L.FuncRefTy, Elem, 3));
+
+    Args.insert(Args.begin(), CalleeInstance);
+    return pushResults(B.CreateCall(CalleeTy, Callee, Args), FT);
+  }
+
+  case 0x1A: // drop
+    return pop(nullptr) != nullptr;
+
+  case 0x1B: // select
+  case 0x1C: // select t
+  {
+    Type *Ty = nullptr;
+    if (Opcode == 0x1C) {
+      if (R.readU32() != 1 || !(Ty = L.getValueType(R.readByte()))) {
+        return fail("unsupported select type");
+      }
+    }
+
+    auto Cond = pop(I32Ty);
+    auto False = Cond ? pop(Ty) : nullptr;
+    auto True = False ? pop(False->getType()) : nullptr;
+    if (!True) {
+      return false;
+    }
+    push(B.CreateSelect(B.CreateICmpNE(Cond, B.getInt32(0)), True, False));
+    return true;
+  }
+
+  case 0x20: // local.get
+  case 0x21: // local.set
+  case 0x22: // local.tee
+  {
+    uint32_t Local = R.readU32();
+    if (Local >= Locals.size()) {
+      return fail("unknown local");
+    }
+
+    auto Slot = Locals[Local];
+    if (Opcode == 0x20) {
+      push(B.CreateLoad(Slot->getAllocatedType(), Slot));
+      return true;
+    }
+
+    auto V = pop(Slot->getAllocatedType());
+    if (!V) {
+      return false;
+    }
+    B.CreateStore(V, Slot);
+    if (Opcode == 0x22) {
+      push(V);
+    }
+    return true;
+  }
+
+  case 0x23: // global.get
+  case 0x24: // global.set
+  {
+    uint32_t Global = R.readU32();
+    if (Global >= L.Globals.size()) {
+      return fail("unknown global");
+    }
+
+    auto Ty = L.getValueType(L.Globals[Global].Type);
+    if (!Ty) {
+      return false;
+    }
+
+    if (Opcode == 0x23) {
+      push(B.CreateLoad(Ty, L.getGlobalPtr(B, Instance, Global)));
+      return true;
+    }
+
+    auto V = pop(Ty);
+    if (!V) {
+      return false;
+    }
+    B.CreateStore(V, L.getGlobalPtr(B, Instance, Global));
+    return true;
+  }
+
+  case 0x3F: // memory.size
+  case 0x40: // memory.grow
+  {
+    if (R.readByte() != 0) {
+      return fail("multiple memories are not supported");
+    }
+    if (L.Memories.empty()) {
+      return fail("memory instruction without a memory");
+    }
+
+    auto Memory = L.getMemoryPtr(B, Instance, 0);
+    if (Opcode == 0x3F) {
+      auto Pages = B.CreateLoad(B.getInt64Ty(),
+                                B.CreateStructGEP(L.MemoryTy, Memory, 1));
+      push(B.CreateTrunc(Pages, I32Ty));
+      return true;
+    }
+
+    auto Delta = pop(I32Ty);
+    if (!Delta) {
+      return false;
+    }
+    auto Grow = L.M->getOrInsertFunction(
+        "wasm_rt_grow_memory",
+        FunctionType::get(B.getInt64Ty(), {L.PtrTy, B.getInt64Ty()}, false));
+    auto Result =
+        B.CreateCall(Grow, {Memory, B.CreateZExt(Delta, B.getInt64Ty())});
+    push(B.CreateTrunc(Result, I32Ty));
+    return true;
+  }
+
+  case 0x41: // i32.const
+    push(B.getInt32(R.readSLEB()));
+    return true;
+
+  case 0x42: // i64.const
+    push(B.getInt64(R.readSLEB()));
+    return true;
+
+  case 0x43: // f32.const
+    push(ConstantFP::get(L.Context, APFloat(APFloat::IEEEsingle(),
+                                            APInt(32, R.readFixed(4)))));
+    return true;
+
+  case 0x44: // f64.const
+    push(ConstantFP::get(L.Context, APFloat(APFloat::IEEEdouble(),
+                                            APInt(64, R.readFixed(8)))));
+    return true;
+
+  case 0xFC:
+    return liftPrefixed(R);
+
+  default:
+    break;
+  }
+
+  // Loads
+  if (Opcode >= 0x28 && Opcode <= 0x35) {
+    static const struct {
+      uint8_t Result;
+      unsigned Bits;
+      bool Signed;
+    } Loads[] = {
+        {WASM_I32, 32, false}, {WASM_I64, 64, false}, {WASM_F32, 32, false},
+        {WASM_F64, 64, false}, {WASM_I32, 8, true},   {WASM_I32, 8, false},
+        {WASM_I32, 16, true},  {WASM_I32, 16, false}, {WASM_I64, 8, true},
+        {WASM_I64, 8, false},  {WASM_I64, 16, true},  {WASM_I64, 16, false},
+        {WASM_I64, 32, true},  {WASM_I64, 32, false},
+    };
+    auto &Load = Loads[Opcode - 0x28];
+    auto Ty = L.getValueType(Load.Result);
+    auto Address = getAddress(R, pop(I32Ty));
+    if (!Address) {
+      return false;
+    }
+
+    if (Ty->isFloatingPointTy() || Ty->getIntegerBitWidth() == Load.Bits) {
+      push(B.CreateAlignedLoad(Ty, Address, MaybeAlign(1)));
+      return true;
+    }
+
+    auto V = B.CreateAlignedLoad(B.getIntNTy(Load.Bits), Address, MaybeAlign(1));
+    push(Load.Signed ? B.CreateSExt(V, Ty) : B.CreateZExt(V, Ty));
+    return true;
+  }
+
+  // Stores
+  if (Opcode >= 0x36 && Opcode <= 0x3E) {
+    static const struct {
+      uint8_t Value;
+      unsigned Bits;
+    } Stores[] = {
+        {WASM_I32, 32}, {WASM_I64, 64}, {WASM_F32, 32},
+        {WASM_F64, 64}, {WASM_I32, 8},  {WASM_I32, 16},
+        {WASM_I64, 8},  {WASM_I64, 16}, {WASM_I64, 32},
+    };
+    auto &Store = Stores[Opcode - 0x36];
+    auto Ty = L.getValueType(Store.Value);
+    auto V = pop(Ty);
+    auto Address = V ? getAddress(R, pop(I32Ty)) : nullptr;
+    if (!Address) {
+      return false;
+    }
+
+    if (!Ty->isFloatingPointTy() && Ty->getIntegerBitWidth() != Store.Bits) {
+      V = B.CreateTrunc(V, B.getIntNTy(Store.Bits));
+    }
+    B.CreateAlignedStore(V, Address, MaybeAlign(1));
+    return true;
+  }
+
+  return liftNumeric(Opcode);
+}
+
+bool FunctionLifter::lift() {
+  auto Entry = BasicBlock::Create(L.Context, "entry", F);
+  B.SetInsertPoint(Entry);
+  Instance = F->getArg(0);
+
+  // Params and locals live in allocas until SROA promotes them
+  auto &FT = L.Types[Func.Type];
+  for (unsigned i = 0; i < FT.Params.size(); i++) {
+    auto Arg = F->getArg(i + 1);
+    Arg->setName("var_p" + Twine(i));
+    auto Slot = B.CreateAlloca(Arg->getType());
+    B.CreateStore(Arg, Slot);
+    Locals.push_back(Slot);
+  }
+
+  WasmReader R(Func.Body);
+  uint32_t Groups = R.readU32();
+  for (uint32_t i = 0; i < Groups && !R.failed(); i++) {
+    uint32_t Count = R.readU32();
+    auto Ty = L.getValueType(R.readByte());
+    if (!Ty) {
+      return false;
+    }
+    if (Locals.size() + Count > 50000) {
+      return fail("too many locals");
+    }
+
+    for (uint32_t j = 0; j < Count; j++) {
+      auto Slot = B.CreateAlloca(Ty);
+      B.CreateStore(Constant::getNullValue(Ty), Slot);
+      Locals.push_back(Slot);
+    }
+  }
+
+  SmallVector<Type *, 1> Results;
+  for (auto Result : FT.Results) {
+    Results.push_back(L.getValueType(Result));
+  }
+  createFrame(FrameKind::Function, {}, Results, "return");
+
+  while (!Frames.empty()) {
+    Offset = R.getOffset();
+    uint8_t Opcode = R.readByte();
+    if (R.failed()) {
+      return fail("unexpected end of the function body");
+    }
+
+    if (!lift(R, Opcode)) {
+      return false;
+    }
+    if (R.failed()) {
+      return fail("truncated instruction");
+    }
+  }
+
+  // Drop the code following branches
+  removeUnreachableBlocks(*F);
+  return true;
+}
+
+} // namespace
+
+Expected<std::unique_ptr<Module>> liftWasm(MemoryBufferRef Buffer,
+                                           StringRef ModuleName,
+                                           LLVMContext &Context) {
+  return WasmLifter(Buffer, ModuleName, Context).lift();
+}
+
+} // namespace squanchy
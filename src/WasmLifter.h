@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+namespace llvm {
+class LLVMContext;
+class MemoryBufferRef;
+class Module;
+} // namespace llvm
+
+namespace squanchy {
+
+/*
+ * Lift a wasm binary into a module that follows the wasm2c conventions: the
+ * instance struct 'struct.w2c_<ModuleName>', functions taking the instance as
+ * first argument, imports through 'w2c_<module>_<field>' accessors and
+ * 'wasm2c_<ModuleName>_instantiate'. Only the MVP with the sign extension,
+ * saturating truncation and bulk memory copy/fill extensions is supported.
+ */
+llvm::Expected<std::unique_ptr<llvm::Module>>
+liftWasm(llvm::MemoryBufferRef Buffer, llvm::StringRef ModuleName,
+         llvm::LLVMContext &Context);
+
+} // namespace squanchy
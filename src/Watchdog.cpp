@@ -0,0 +1,56 @@
+#include "Watchdog.h"
+
+#include "llvm/Support/Process.h"
+
+using namespace llvm;
+
+namespace squanchy {
+
+void Watchdog::arm(unsigned TimeoutSeconds, uint64_t MemoryLimitMB) {
+  this->Armed = TimeoutSeconds || MemoryLimitMB;
+  this->Start = std::chrono::steady_clock::now();
+  this->TimeoutSeconds = TimeoutSeconds;
+  this->MemoryLimitMB = MemoryLimitMB;
+  this->Reason.clear();
+}
+
+void Watchdog::disarm() { Armed = false; }
+
+bool Watchdog::expired() {
+  if (!Armed) {
+    return false;
+  }
+
+  if (!Reason.empty()) {
+    return true;
+  }
+
+  auto Elapsed = std::chrono::steady_clock::now() - Start;
+  if (TimeoutSeconds && Elapsed >= std::chrono::seconds(TimeoutSeconds)) {
+    Reason = "timeout after " + std::to_string(TimeoutSeconds) + "s";
+    return true;
+  }
+
+  // Heap of the whole process, shared by all workers
+  uint64_t UsageMB = sys::Process::GetMallocUsage() >> 20;
+  if (MemoryLimitMB && UsageMB >= MemoryLimitMB) {
+    Reason = "memory limit of " + std::to_string(MemoryLimitMB) +
+             "MB exceeded (" + std::to_string(UsageMB) + "MB)";
+    return true;
+  }
+
+  return false;
+}
+
+unsigned Watchdog::getRemainingMs() {
+  if (!Armed || !TimeoutSeconds) {
+    return 0;
+  }
+
+  auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - Start);
+  int64_t Remaining = (int64_t)TimeoutSeconds * 1000 - Elapsed.count();
+  return Remaining > 1 ? (unsigned)Remaining : 1;
+}
+
+} // namespace squanchy
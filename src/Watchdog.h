@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace squanchy {
+
+/*
+ * Time and memory limit of the function currently being deobfuscated. The
+ * pipelines poll expired() between passes and stop early once it trips,
+ * the reason stays latched until the watchdog is armed again.
+ */
+class Watchdog {
+public:
+  /*
+   * Start watching, 0 disables the respective limit
+   */
+  void arm(unsigned TimeoutSeconds, uint64_t MemoryLimitMB);
+  void disarm();
+
+  bool isArmed() { return Armed; }
+
+  /*
+   * True once a limit tripped
+   */
+  bool expired();
+
+  const std::string &getReason() { return Reason; }
+
+  /*
+   * Milliseconds left until the timeout, at least 1 once it passed and 0
+   * without a time limit
+   */
+  unsigned getRemainingMs();
+
+private:
+  bool Armed = false;
+  std::chrono::steady_clock::time_point Start;
+  unsigned TimeoutSeconds = 0;
+  uint64_t MemoryLimitMB = 0;
+  std::string Reason = "";
+};
+
+} // namespace squanchy